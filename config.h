@@ -0,0 +1,313 @@
+/* Old versions of ncurses don't support A_ITALIC.
+ * Define this to disable it if the situation isn't automatically detected.
+#define NO_ITALICS
+ */
+
+/* mtm by default will advertise itself as a "screen-bce" terminal.
+ * This is the terminal type advertised by such programs as
+ * screen(1) and tmux(1) and is a widely-supported terminal type.
+ * mtm supports emulating the "screen-bce" terminal very well, and this
+ * is a reasonable default.
+ *
+ * However, you can change the default terminal that mtm will
+ * advertise itself as. There's the "mtm" terminal type that is
+ * recommended for use if you know it will be available in all the
+ * environments in which mtm will be used. It advertises a few
+ * features that mtm has that the default "screen-bce" terminfo doesn't
+ * list, meaning that terminfo-aware programs may get a small
+ * speed boost.
+ */
+#define DEFAULT_TERMINAL "screen-bce"
+#define DEFAULT_256_COLOR_TERMINAL "screen-256color-bce"
+
+/* mtm supports a scrollback buffer, allowing users to scroll back
+ * through the output history of a virtual terminal. The SCROLLBACK
+ * knob controls how many lines are saved, in addition to those
+ * currently displayed. 1000 seems like a good number.
+ * This can be changed at runtime using the '-s' flag.
+ *
+ * Lines are stored compactly, and only once they scroll off the top of
+ * the screen, so a terminal that hasn't scrolled much uses little memory.
+ * The scrollback of all terminals together is limited to HISTORY_BUDGET
+ * bytes; past that, the oldest lines of the terminals that have been
+ * quiet longest are dropped first.
+ */
+#define SCROLLBACK     1000
+#define HISTORY_BUDGET (256 * 1024 * 1024)
+
+/* Rather than being discarded, scrollback lines that no longer fit in
+ * memory are written to files in SPILL_DIR (or $XDG_RUNTIME_DIR if
+ * SPILL_DIR is NULL), up to SPILL_LIMIT bytes for each terminal, and read
+ * back only when scrolled to. The files are removed as soon as they are
+ * created, so nothing is left behind. Set SPILL_LIMIT to 0 to keep
+ * scrollback in memory only.
+ */
+#define SPILL_DIR   NULL
+#define SPILL_LIMIT (1024L * 1024 * 1024)
+
+/* mtm reads from each virtual terminal in chunks of up to READ_SIZE bytes,
+ * draining up to READ_BUDGET bytes from it each time through its main loop
+ * (FOCUSED_BUDGET for the focused terminal, which is also read first).
+ * Once LATENCY_MS milliseconds have been spent reading in one pass, the
+ * rest wait for the next one, so typing and redrawing are never held up
+ * for much longer than that. A background terminal that uses up its whole
+ * budget isn't read again for THROTTLE_MS milliseconds, so the pty's flow
+ * control slows down whatever is writing to it.
+ */
+#define READ_SIZE      16384
+#define READ_BUDGET    (256 * 1024)
+#define FOCUSED_BUDGET (1024 * 1024)
+#define LATENCY_MS     10
+#define THROTTLE_MS    20
+
+/* What's typed into a virtual terminal, and its replies to queries, are
+ * queued if the program in it isn't reading, up to QUEUE_SIZE bytes for
+ * each terminal. While more than half of that is waiting, mtm stops reading
+ * the keyboard until the program catches up, or until it has read nothing
+ * for STALL_MS milliseconds; after that, anything that doesn't fit is
+ * dropped, so that mtm's own commands still work.
+ */
+#define QUEUE_SIZE (256 * 1024)
+#define STALL_MS   2000
+
+/* Text pasted into the host terminal goes to the focused terminal as-is,
+ * command prefix and all, until the host marks the end of the paste. If
+ * none of it comes for PASTE_MS milliseconds, the paste is taken to be
+ * over anyway, so that a lost end mark doesn't leave mtm's commands
+ * unusable.
+ */
+#define PASTE_MS 1000
+
+/* What mtm draws for a client attached to a session (with '-a') is queued
+ * while the client's terminal catches up, up to CLIENT_LIMIT bytes. A
+ * client that falls further behind than that is detached, so that it never
+ * holds up the session; attaching again redraws the screen whole.
+ */
+#define CLIENT_LIMIT (8 * 1024 * 1024)
+
+/* mtm parses output as fast as it arrives, but redraws the screen at most
+ * FRAME_RATE times a second. Keystrokes, and output that arrives in the
+ * focused terminal within ECHO_MS milliseconds of one, are shown at once.
+ * This can be changed at runtime using the '-r' flag; a rate of 0 redraws
+ * after every read, for the lowest latency at the cost of throughput.
+ */
+#define FRAME_RATE 60
+#define ECHO_MS    100
+
+/* A terminal that scrolls more than JUMP_SCREENS screenfuls between two
+ * redraws is flooded with output, and "jump scrolls": until the flood is
+ * over, it's only redrawn every JUMP_MS milliseconds, marked as such, and
+ * the lines in between go straight to scrollback without being shown.
+ */
+#define JUMP_SCREENS 4
+#define JUMP_MS      250
+
+/* A program can ask for its terminal not to be redrawn while it draws a
+ * frame (mode 2026, "synchronized output"), so that half-drawn frames are
+ * never shown. If the frame isn't finished within SYNC_MS milliseconds,
+ * the terminal is drawn anyway, in case the program has gone away.
+ */
+#define SYNC_MS 150
+
+/* Programs can set their virtual terminal's title, which is shown at the
+ * right of the bottom row while it's focused, and copy to the clipboard,
+ * which mtm passes on to the host terminal unless CLIPBOARD is false.
+ * Such strings can be at most OSC_LIMIT bytes long (clipboard copies are
+ * a third larger than what's copied); titles are cut to TITLE_SIZE - 1
+ * characters. The bottom row is only shown while there's more than one
+ * window, unless STATUS_LINE is true.
+ */
+#define CLIPBOARD   true
+#define OSC_LIMIT   (16 * 1024 * 1024)
+#define TITLE_SIZE  256
+#define STATUS_LINE false
+
+/* The default command prefix key, when modified by cntrl.
+ * This can be changed at runtime using the '-c' flag.
+ */
+#define COMMAND_KEY 'g'
+
+/* The change focus keys. */
+#define MOVE_UP         CODE(KEY_UP)
+#define MOVE_DOWN       CODE(KEY_DOWN)
+#define MOVE_RIGHT      CODE(KEY_RIGHT)
+#define MOVE_LEFT       CODE(KEY_LEFT)
+#define MOVE_OTHER      KEY(L'o')
+
+/* The split terminal keys. */
+#define HSPLIT KEY(L'h')
+#define VSPLIT KEY(L'v')
+
+/* The delete terminal key. */
+#define DELETE_NODE KEY(L'w')
+
+/* The force redraw key. */
+#define REDRAW KEY(L'l')
+
+/* The key that detaches from a session started with '-a'. Without '-a',
+ * it's passed on to the focused terminal.
+ */
+#define DETACH KEY(L'd')
+
+/* The key that shows or hides statistics about the current window's
+ * virtual terminals.
+ */
+#define STATISTICS KEY(L'i')
+
+/* The key that starts or stops broadcasting what's typed to other virtual
+ * terminals, and the key that marks or unmarks the focused one as one to
+ * broadcast to. With none marked, everything typed goes to every virtual
+ * terminal in the current window.
+ */
+#define BROADCAST KEY(L'b')
+#define MARK      KEY(L'm')
+
+/* The window keys: open a new window, and switch to the next or previous
+ * one. The digits 1 through 9 switch to the first nine windows directly.
+ */
+#define NEW_WINDOW  KEY(L'c')
+#define NEXT_WINDOW KEY(L'n')
+#define PREV_WINDOW KEY(L'p')
+
+/* The scrollback keys. */
+#define SCROLLUP CODE(KEY_PPAGE)
+#define SCROLLDOWN CODE(KEY_NPAGE)
+#define RECENTER CODE(KEY_END)
+
+/* The search key, and the keys used while searching to go to the next
+ * older or newer match and to switch between searching for plain text
+ * and for a regular expression.
+ */
+#define SEARCH       KEY(L'/')
+#define SEARCH_OLDER KEY(CTL(L'r'))
+#define SEARCH_NEWER KEY(CTL(L's'))
+#define SEARCH_REGEX KEY(CTL(L't'))
+
+/* The path for the wide-character curses library. */
+#ifndef NCURSESW_INCLUDE_H
+    #if defined(__APPLE__) || !defined(__linux__) || defined(__FreeBSD__)
+        #define NCURSESW_INCLUDE_H <curses.h>
+    #else
+        #define NCURSESW_INCLUDE_H <ncursesw/curses.h>
+    #endif
+#endif
+#include NCURSESW_INCLUDE_H
+
+/* Includes needed to make forkpty(3) work. */
+#ifndef FORKPTY_INCLUDE_H
+    #if defined(__APPLE__)
+        #define FORKPTY_INCLUDE_H <util.h>
+    #elif defined(__FreeBSD__)
+        #define FORKPTY_INCLUDE_H <libutil.h>
+    #else
+        #define FORKPTY_INCLUDE_H <pty.h>
+    #endif
+#endif
+#include FORKPTY_INCLUDE_H
+
+/* You probably don't need to alter these much, but if you do,
+ * here is where you can define alternate character sets.
+ *
+ * Note that if your system's wide-character implementation
+ * maps directly to Unicode, the preferred Unicode characters
+ * will be used automatically if your system declares such
+ * support. If it doesn't declare it, define WCHAR_IS_UNICODE to
+ * force Unicode to be used.
+ */
+#define MAXMAP 0x7f
+static wchar_t CSET_US[MAXMAP]; /* "USASCII"...really just the null table */
+
+#if defined(__STDC_ISO_10646__) || defined(WCHAR_IS_UNICODE)
+static wchar_t CSET_UK[MAXMAP] ={ /* "United Kingdom"...really just Pound Sterling */
+    [L'#'] = 0x00a3
+};
+
+static wchar_t CSET_GRAPH[MAXMAP] ={ /* Graphics Set One */
+    [L'-'] = 0x2191,
+    [L'}'] = 0x00a3,
+    [L'~'] = 0x00b7,
+    [L'{'] = 0x03c0,
+    [L','] = 0x2190,
+    [L'+'] = 0x2192,
+    [L'.'] = 0x2193,
+    [L'|'] = 0x2260,
+    [L'>'] = 0x2265,
+    [L'`'] = 0x25c6,
+    [L'a'] = 0x2592,
+    [L'b'] = 0x2409,
+    [L'c'] = 0x240c,
+    [L'd'] = 0x240d,
+    [L'e'] = 0x240a,
+    [L'f'] = 0x00b0,
+    [L'g'] = 0x00b1,
+    [L'h'] = 0x2592,
+    [L'i'] = 0x2603,
+    [L'j'] = 0x2518,
+    [L'k'] = 0x2510,
+    [L'l'] = 0x250c,
+    [L'm'] = 0x2514,
+    [L'n'] = 0x253c,
+    [L'o'] = 0x23ba,
+    [L'p'] = 0x23bb,
+    [L'q'] = 0x2500,
+    [L'r'] = 0x23bc,
+    [L's'] = 0x23bd,
+    [L't'] = 0x251c,
+    [L'u'] = 0x2524,
+    [L'v'] = 0x2534,
+    [L'w'] = 0x252c,
+    [L'x'] = 0x2502,
+    [L'y'] = 0x2264,
+    [L'z'] = 0x2265,
+    [L'_'] = L' ',
+    [L'0'] = 0x25ae
+};
+
+#else /* wchar_t doesn't map to Unicode... */
+
+static wchar_t CSET_UK[] ={ /* "United Kingdom"...really just Pound Sterling */
+    [L'#'] = L'&'
+};
+
+static wchar_t CSET_GRAPH[] ={ /* Graphics Set One */
+    [L'-'] = '^',
+    [L'}'] = L'&',
+    [L'~'] = L'o',
+    [L'{'] = L'p',
+    [L','] = L'<',
+    [L'+'] = L'>',
+    [L'.'] = L'v',
+    [L'|'] = L'!',
+    [L'>'] = L'>',
+    [L'`'] = L'+',
+    [L'a'] = L':',
+    [L'b'] = L' ',
+    [L'c'] = L' ',
+    [L'd'] = L' ',
+    [L'e'] = L' ',
+    [L'f'] = L'\'',
+    [L'g'] = L'#',
+    [L'h'] = L'#',
+    [L'i'] = L'i',
+    [L'j'] = L'+',
+    [L'k'] = L'+',
+    [L'l'] = L'+',
+    [L'm'] = L'+',
+    [L'n'] = '+',
+    [L'o'] = L'-',
+    [L'p'] = L'-',
+    [L'q'] = L'-',
+    [L'r'] = L'-',
+    [L's'] = L'_',
+    [L't'] = L'+',
+    [L'u'] = L'+',
+    [L'v'] = L'+',
+    [L'w'] = L'+',
+    [L'x'] = L'|',
+    [L'y'] = L'<',
+    [L'z'] = L'>',
+    [L'_'] = L' ',
+    [L'0'] = L'#',
+};
+
+#endif
@@ -13,31 +13,60 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <locale.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <regex.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 #include <wctype.h>
 
 #include "vtparser.h"
 
+#ifdef __linux__
+    #include <sys/epoll.h>
+#endif
+
 /*** CONFIGURATION */
 #include "config.h"
 
 #define MIN(x, y) ((x) < (y)? (x) : (y))
 #define MAX(x, y) ((x) > (y)? (x) : (y))
 #define CTL(x) ((x) & 0x1f)
-#define USAGE "usage: mtm [-T NAME] [-t NAME] [-c KEY]\n"
+#define MAXREADY 64
+#define MINQUEUE 4096
+#define PASTE_START (KEY_MAX + 1)
+#define PASTE_END   (KEY_MAX + 2)
+#define PADHEIGHT(h) ((h) * 3) /* the primary screen scrolls down its pad */
+#define SEGMENT_SIZE (8 * 1024 * 1024)
+#define PAIRBUCKETS 4096
+#define BLOCKLINES 64
+#define BLOOMLOG 12
+#define BLOOMBITS (1 << BLOOMLOG)
+#define MAXQUERY 128
+#define STATS_MS 1000
+#define USAGE "usage: mtm [-T NAME] [-t NAME] [-c KEY] [-r HZ] [-s LINES]\n" \
+              "           [-a NAME] [-L FILE] [-P FILE]\n"                   \
+              "           [-B FILE [-N PANES]]\n"
 
 /*** DATA TYPES */
 typedef enum{
@@ -46,10 +75,69 @@ typedef enum{
     VIEW
 } Node;
 
+typedef struct SPAN SPAN;
+struct SPAN{
+    attr_t attr;
+    int fg, bg, n;  /* colors, not pairs: those are reused for other colors */
+};
+
+typedef struct LINE LINE;
+struct LINE{
+    int nspans, ntext;
+    SPAN spans[]; /* followed by ntext bytes of text */
+};
+#define LINETEXT(l) ((char *)((l)->spans + (l)->nspans))
+
+typedef struct PACKING PACKING;
+struct PACKING{ /* a line being packed a cell at a time */
+    SPAN *spans;
+    char *text;
+    int cap, nspans, ntext, ncells, last;
+};
+
+/* ncurses lays cchar_t out in public, and taking cells apart by reading
+ * it is much faster than getcchar(), which would be called for every cell
+ * of every line that scrolls. With other curses, or with PORTABLE_CELLS
+ * defined, cells are only touched through getcchar() and setcchar().
+ */
+#if defined(NCURSES_VERSION) && !defined(PORTABLE_CELLS)
+    #define CELLFIELDS 1
+#else
+    #define CELLFIELDS 0
+#endif
+#ifndef CCHARW_MAX
+    #define CCHARW_MAX 5
+#endif
+
+typedef uint64_t BLOOM[BLOOMBITS / 64];
+
+typedef struct STATS STATS;
+struct STATS{ /* what a view has cost, besides what its parser counts */
+    unsigned long read, scrolls, frames;
+    double parse, draw; /* seconds */
+};
+
+typedef struct PAIR PAIR;
+struct PAIR{
+    int fg, bg;
+    int chain;          /* the next pair in the same hash bucket */
+    int newer, older;   /* neighbours in order of last use */
+};
+
+typedef struct SEGMENT SEGMENT;
+struct SEGMENT{
+    FILE *f;
+    int nlines, nmapped;
+    size_t size;
+    char *map;
+    uint32_t *index;
+};
+
 typedef struct SCRN SCRN;
 struct SCRN{
     int sy, sx, vis, tos, off;
-    short fg, bg, sfg, sbg, sp;
+    int fg, bg, sfg, sbg;
+    short sp;
     bool insert, oxenl, xenl, saved;
     attr_t sattr;
     WINDOW *win;
@@ -58,27 +146,79 @@ struct SCRN{
 typedef struct NODE NODE;
 struct NODE{
     Node t;
-    int y, x, h, w, pt, ntabs;
-    bool *tabs, pnm, decom, am, lnm;
+    int id, y, x, h, w, pt, ntabs, slot, dlo, dhi, hlen, hhead, hcap, hmax;
+    int nspill, nsegs, nblooms, bcap, scrolled;
+    long hbase, bloom0;
+    size_t spillsize, outhead, outlen, outcap, hbytes, osclen, osccap;
+    double resume, active, drained, jumped, synced;
+    bool *tabs, pnm, decom, am, lnm, paste, armed, unsent, jumping, sync, oscover;
+    bool marked;
     wchar_t repc;
-    NODE *p, *c1, *c2;
+    NODE *p, *c1, *c2, *nextpaused, *nextunsent;
     SCRN pri, alt, *s;
+    LINE **hist;
+    SEGMENT *segs;
+    BLOOM *bloom;
+    char *out, *osc;
+    wchar_t *title;
+    WINDOW *hwin;
+    STATS st;
     wchar_t *g0, *g1, *g2, *g3, *gc, *gs, *sgc, *sgs;
     VTPARSER vp;
 };
 
+typedef struct WIN WIN;
+struct WIN{ /* a window: a tree of views filling the screen when shown */
+    NODE *root, *focused, *lastfocused;
+    bool active;    /* has it printed anything since it was last shown? */
+};
+
 /*** GLOBALS AND PROTOTYPES */
-static NODE *root, *focused, *lastfocused = NULL;
-static int commandkey = CTL(COMMAND_KEY), nfds = 1; /* stdin */
-static fd_set fds;
-static char iobuf[BUFSIZ];
+static NODE *root, *focused, *lastfocused = NULL, *paused = NULL, *unsent = NULL;
+static NODE *ready[MAXREADY];
+static int commandkey = CTL(COMMAND_KEY), nready = 0, framerate = FRAME_RATE;
+static int histmax = SCROLLBACK;
+static WIN *wins;   /* the shown window's entry is only updated as it's hidden */
+static int nwins = 1, curwin = 0;
+static size_t histbytes = 0;
+static const char *spilldir = SPILL_DIR, *sessionpath = NULL;
+static bool headless = false, relayout = true, hostpaste = false, held = false;
+static bool showstats = false, broadcast = false;
+static int nmarked = 0;        /* views marked to be broadcast to */
+static struct{
+    NODE *from;
+    char *b;
+    size_t len, cap;
+} typed;                        /* keys to broadcast from a view */
+static struct{
+    NODE *to;           /* the view a paste is going to, if any */
+    bool marked;        /* was it told that a paste started */
+    double last;        /* when the last of it came */
+} paste;
+static FILE *playback = NULL;   /* the recording being replayed */
+static unsigned long loops = 0;
+static double updatetime = 0.0;
+static char iobuf[READ_SIZE];
+static int keyfd = STDIN_FILENO;
+#ifdef __linux__
+static int epfd = -1;
+#else
+static struct pollfd *pfds;
+static NODE **pnodes;
+static int npfds, maxpfds, keyslot, clientslot = -1;
+#endif
+static VTCALLBACKS callbacks;
 
-static void setupevents(NODE *n);
+static void setupevents(void);
 static void reshape(NODE *n, int y, int x, int h, int w);
-static void draw(NODE *n);
 static void reshapechildren(NODE *n);
 static const char *term = NULL;
 static void freenode(NODE *n, bool recursive);
+static void endsearch(bool keep);
+static void unwatch(NODE *n);
+static void queue(NODE *n, const char *b, size_t c);
+static void endrecording(void);
+static bool syncing(NODE *n);
 
 /*** UTILITY FUNCTIONS */
 static void
@@ -86,24 +226,36 @@ quit(int rc, const char *m) /* Shut down MTM. */
 {
     if (m)
         fprintf(stderr, "%s\n", m);
-    if (root)
-        freenode(root, true);
+    endrecording(); /* with the final screen */
+    for (int i = 0; i < nwins; i++)
+        freenode(i == curwin? root : wins[i].root, true);
+    if (hostpaste)
+        putp("\033[?2004l");
     endwin();
+    if (sessionpath)
+        unlink(sessionpath);
     exit(rc);
 }
 
+static double
+now(void) /* Monotonic time in seconds. */
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 static void
-safewrite(int fd, const char *b, size_t n) /* Write, checking for errors. */
+touch(NODE *n, int lo, int hi) /* Mark rows lo through hi of n as changed. */
 {
-    size_t w = 0;
-    while (w < n){
-        ssize_t s = write(fd, b + w, n - w);
-        if (s < 0 && errno != EINTR)
-            return;
-        else if (s < 0)
-            s = 0;
-        w += (size_t)s;
-    }
+    n->dlo = MIN(n->dlo, MAX(lo, 0));
+    n->dhi = MAX(n->dhi, MIN(hi, n->h - 1));
+}
+
+static int
+layoutlines(void) /* Rows for views, leaving room for the window list. */
+{
+    return LINES - (nwins > 1 || STATUS_LINE);
 }
 
 static const char *
@@ -117,563 +269,2931 @@ getshell(void) /* Get the user's preferred shell. */
     return "/bin/sh";
 }
 
-/*** TERMINAL EMULATION HANDLERS
- * These functions implement the various terminal commands activated by
- * escape sequences and printing to the terminal. Large amounts of boilerplate
- * code is shared among all these functions, and is factored out into the
- * macros below:
- *      PD(n, d)       - Parameter n, with default d.
- *      P0(n)          - Parameter n, default 0.
- *      P1(n)          - Parameter n, default 1.
- *      CALL(h)        - Call handler h with no arguments.
- *      SENDN(n, s, c) - Write string c bytes of s to n.
- *      SEND(n, s)     - Write string s to node n's host.
- *      (END)HANDLER   - Declare/end a handler function
- *      COMMONVARS     - All of the common variables for a handler.
- *                       x, y     - cursor position
- *                       mx, my   - max possible values for x and y
- *                       px, py   - physical cursor position in scrollback
- *                       n        - the current node
- *                       win      - the current window
- *                       top, bot - the scrolling region
- *                       tos      - top of the screen in the pad
- *                       s        - the current SCRN buffer
- * The funny names for handlers are from their ANSI/ECMA/DEC mnemonics.
+static bool
+userdir(char *b, size_t n) /* Find, or make, a directory only we can get into. */
+{
+    struct stat st;
+    const char *x = getenv("XDG_RUNTIME_DIR"), *t = getenv("TMPDIR");
+    int l = x && *x? snprintf(b, n, "%s/mtm", x)
+          : snprintf(b, n, "%s/mtm-%ld", t && *t? t : "/tmp", (long)getuid());
+    if (l < 0 || (size_t)l >= n || (mkdir(b, 0700) != 0 && errno != EEXIST))
+        return false;
+    return lstat(b, &st) == 0 && S_ISDIR(st.st_mode) /* not a link */
+        && st.st_uid == getuid() && !(st.st_mode & 077);
+}
+
+/*** COLORS
+ * ncurses has a limited number of color pairs, so mtm hands them out
+ * itself: a hash table maps each foreground and background in use to its
+ * pair, and once every pair is taken the least recently used one is
+ * redefined (which changes the color of anything still on screen in it;
+ * scrollback keeps colors, and gets pairs for them as it's drawn).
+ *
+ * Direct RGB colors are passed straight through to hosts that support
+ * them. Otherwise, they're mapped to the nearest color in the host's
+ * palette using a table of 32 levels per channel, built on first use.
+ *
+ * A session's clients can have different terminals, but curses can't
+ * take on more colors than the first one had, so the host's palette is
+ * hostcolors, the smaller of the two. When it changes, the pairs in use
+ * are redefined to fit it.
  */
-#define PD(x, d) (argc < (x) || !argv? (d) : argv[(x)])
-#define P0(x) PD(x, 0)
-#define P1(x) (!P0(x)? 1 : P0(x))
-#define CALL(x) (x)(v, n, 0, 0, 0, NULL, NULL)
-#define SENDN(n, s, c) safewrite(n->pt, s, c)
-#define SEND(n, s) SENDN(n, s, strlen(s))
-#define COMMONVARS                                                      \
-    NODE *n = (NODE *)p;                                                \
-    SCRN *s = n->s;                                                     \
-    WINDOW *win = s->win;                                               \
-    int py, px, y, x, my, mx, top = 0, bot = 0, tos = s->tos;           \
-    (void)v; (void)p; (void)w; (void)iw; (void)argc; (void)argv;        \
-    (void)win; (void)y; (void)x; (void)my; (void)mx; (void)osc;         \
-    (void)tos;                                                          \
-    getyx(win, py, px); y = py - s->tos; x = px;                        \
-    getmaxyx(win, my, mx); my -= s->tos;                                \
-    wgetscrreg(win, &top, &bot);                                        \
-    bot++; bot -= s->tos;                                               \
-    top = top <= tos? 0 : top - tos;                                    \
+static PAIR *pairs; /* indexed by pair number; pair 0 is the default */
+static int npairs = 1, maxpairs, newest, oldest, buckets[PAIRBUCKETS];
+static int hostcolors;
 
-#define HANDLER(name)                                   \
-    static void                                         \
-    name (VTPARSER *v, void *p, wchar_t w, wchar_t iw,  \
-          int argc, int *argv, const wchar_t *osc)      \
-    { COMMONVARS
-#define ENDHANDLER n->repc = 0; } /* control sequences aren't repeated */
+static unsigned
+pairhash(int fg, int bg)
+{
+    return ((unsigned)fg * 31u + (unsigned)bg * 2654435761u) % PAIRBUCKETS;
+}
 
-HANDLER(bell) /* Terminal bell. */
-    beep();
-ENDHANDLER
+static void
+unlinkpair(int p) /* Take pair p out of the order of use. */
+{
+    if (pairs[p].newer)
+        pairs[pairs[p].newer].older = pairs[p].older;
+    else
+        newest = pairs[p].older;
+    if (pairs[p].older)
+        pairs[pairs[p].older].newer = pairs[p].newer;
+    else
+        oldest = pairs[p].newer;
+}
 
-HANDLER(numkp) /* Application/Numeric Keypad Mode */
-    n->pnm = (w == L'=');
-ENDHANDLER
+static void
+usepair(int p) /* Make pair p the most recently used. */
+{
+    if (p == newest)
+        return;
+    unlinkpair(p);
+    pairs[p].newer = 0;
+    pairs[p].older = newest;
+    pairs[newest].newer = p;
+    newest = p;
+}
 
-HANDLER(vis) /* Cursor visibility */
-    s->vis = iw == L'6'? 0 : 1;
-ENDHANDLER
+static int
+newpair(void) /* Find a free pair, or reclaim the least recently used one. */
+{
+    if (!maxpairs)
+        maxpairs = MIN(COLOR_PAIRS, SHRT_MAX);
+    if (npairs >= maxpairs && !oldest)
+        return 0;
+    else if (npairs >= maxpairs){
+        int p = oldest, *c = &buckets[pairhash(pairs[p].fg, pairs[p].bg)];
+        while (*c != p)
+            c = &pairs[*c].chain;
+        *c = pairs[p].chain;
+        return p;
+    }
+    if (npairs % 256 == 1){
+        PAIR *np = realloc(pairs, (npairs + 256) * sizeof(PAIR));
+        if (!np)
+            return 0;
+        pairs = np;
+    }
+    pairs[npairs] = (PAIR){.older = newest};
+    if (newest)
+        pairs[newest].newer = npairs;
+    newest = npairs;
+    oldest = oldest? oldest : npairs;
+    return npairs++;
+}
 
-HANDLER(cup) /* CUP - Cursor Position */
-    s->xenl = false;
-    wmove(win, tos + (n->decom? top : 0) + P1(0) - 1, P1(1) - 1);
-ENDHANDLER
+static int
+colorpair(int fg, int bg) /* Get the pair for fg on bg. */
+{
+    if (fg == -1 && bg == -1)
+        return 0;
+    int *b = &buckets[pairhash(fg, bg)], p = *b;
+    while (p && (pairs[p].fg != fg || pairs[p].bg != bg))
+        p = pairs[p].chain;
+    if (!p && (p = newpair())){
+        #if NCURSES_EXT_COLORS
+        init_extended_pair(p, fg, bg);
+        #else
+        init_pair((short)p, (short)fg, (short)bg);
+        #endif
+        pairs[p].fg = fg;
+        pairs[p].bg = bg;
+        pairs[p].chain = *b;
+        *b = p;
+    }
+    if (p)
+        usepair(p);
+    return p;
+}
 
-HANDLER(dch) /* DCH - Delete Character */
-    for (int i = 0; i < P1(0); i++)
-        wdelch(win);
-ENDHANDLER
+static void
+xtermrgb(int c, int *r, int *g, int *b) /* Get color c of xterm's palette. */
+{
+    static const int basic[16] ={
+        0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd, 0x00cdcd,
+        0xe5e5e5, 0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00, 0x5c5cff, 0xff00ff,
+        0x00ffff, 0xffffff
+    };
+    #define LEVEL(i) ((i)? (i) * 40 + 55 : 0)
+    if (c < 16){
+        *r = basic[c] >> 16;
+        *g = basic[c] >> 8 & 0xff;
+        *b = basic[c] & 0xff;
+    } else if (c < 232){
+        *r = LEVEL((c - 16) / 36);
+        *g = LEVEL((c - 16) / 6 % 6);
+        *b = LEVEL((c - 16) % 6);
+    } else
+        *r = *g = *b = (c - 232) * 10 + 8;
+}
 
-HANDLER(ich) /* ICH - Insert Character */
-    for (int i = 0; i < P1(0); i++)
-        wins_nwstr(win, L" ", 1);
-ENDHANDLER
+static short *rgbmap;
 
-HANDLER(cuu) /* CUU - Cursor Up */
-    wmove(win, MAX(py - P1(0), tos + top), x);
-ENDHANDLER
+static void
+makergbmap(void) /* Map 32 levels of each channel to the host's colors. */
+{
+    short *map = malloc(32 * 32 * 32 * sizeof(short));
+    if (map){
+        int lo = hostcolors >= 256? 16 : 0; /* avoid 0-15, which are themed */
+        int hi = hostcolors >= 256? 256 : hostcolors >= 16? 16 : 8;
+        for (int i = 0; i < 32 * 32 * 32; i++){
+            int cr = (i >> 10) * 8 + 4, cg = (i >> 5 & 31) * 8 + 4, cb = (i & 31) * 8 + 4;
+            long best = LONG_MAX;
+            for (int c = lo; c < hi; c++){
+                int pr, pg, pb;
+                xtermrgb(c, &pr, &pg, &pb);
+                long d = 2L * (pr - cr) * (pr - cr) + 4L * (pg - cg) * (pg - cg)
+                       + 3L * (pb - cb) * (pb - cb);
+                if (d < best){
+                    best = d;
+                    map[i] = (short)c;
+                }
+            }
+        }
+    }
+    rgbmap = map;
+}
 
-HANDLER(cud) /* CUD - Cursor Down */
-    wmove(win, MIN(py + P1(0), tos + bot - 1), x);
-ENDHANDLER
+static int
+rgbcolor(int r, int g, int b) /* Find the host's color nearest r, g, b. */
+{
+    #if NCURSES_EXT_COLORS
+    if (hostcolors >= 0x1000000)
+        return r << 16 | g << 8 | b;
+    #endif
+    if (!rgbmap)
+        makergbmap();
+    return rgbmap? rgbmap[(r >> 3) << 10 | (g >> 3) << 5 | b >> 3] : -1;
+}
 
-HANDLER(cuf) /* CUF - Cursor Forward */
-    wmove(win, py, MIN(x + P1(0), mx - 1));
-ENDHANDLER
+static int
+indexcolor(int c) /* Find the host's color nearest color c of 256. */
+{
+    int r, g, b;
+    if (c < 0 || c > 255)
+        return -1;
+    if (c < hostcolors)
+        return c;
+    xtermrgb(c, &r, &g, &b);
+    return rgbcolor(r, g, b);
+}
 
-HANDLER(ack) /* ACK - Acknowledge Enquiry */
-    SEND(n, "\006");
-ENDHANDLER
+static int
+fitcolor(int c) /* Find the nearest color to c that the host still has. */
+{
+    if (c < hostcolors)
+        return c;
+    return c < 256? indexcolor(c) : rgbcolor(c >> 16, c >> 8 & 0xff, c & 0xff);
+}
 
-HANDLER(hts) /* HTS - Horizontal Tab Set */
-    if (x < n->ntabs && x > 0)
-        n->tabs[x] = true;
-ENDHANDLER
+static void
+fitcolors(void) /* Fit the pairs in use to the host's palette. */
+{
+    int c = tigetnum("colors");
+    if (c == hostcolors)
+        return;
+    hostcolors = MIN(MAX(c, 0), COLORS);
+    free(rgbmap);
+    rgbmap = NULL;
+    memset(buckets, 0, sizeof(buckets));
+    for (int p = 1; p < npairs; p++){
+        pairs[p].fg = fitcolor(pairs[p].fg);
+        pairs[p].bg = fitcolor(pairs[p].bg);
+        #if NCURSES_EXT_COLORS
+        init_extended_pair(p, pairs[p].fg, pairs[p].bg);
+        #else
+        init_pair((short)p, (short)pairs[p].fg, (short)pairs[p].bg);
+        #endif
+        int *b = &buckets[pairhash(pairs[p].fg, pairs[p].bg)];
+        pairs[p].chain = *b;
+        *b = p;
+    }
+}
 
-HANDLER(ri) /* RI - Reverse Index */
-    int otop = 0, obot = 0;
-    wgetscrreg(win, &otop, &obot);
-    wsetscrreg(win, otop >= tos? otop : tos, obot);
-    y == top? wscrl(win, -1) : wmove(win, MAX(tos, py - 1), x);
-    wsetscrreg(win, otop, obot);
-ENDHANDLER
+/*** SCROLLBACK
+ * A view's primary screen is the h rows of its pad starting at row tos.
+ * When the whole screen scrolls up, its top row is saved to the view's
+ * scrollback and tos moves down a row, so the rest of the screen stays
+ * where it is. Only once tos runs out of pad is the screen copied back to
+ * the top. A scrolled-back view shows its last off lines of scrollback
+ * above the top of the screen.
+ *
+ * The scrollback is a ring of packed lines that grows as it fills, up to
+ * the view's hmax lines. A packed line is a list of spans of cells with
+ * the same attributes and colors, followed by the cells' text in UTF-8,
+ * with trailing blanks left off. Spans keep colors rather than pairs,
+ * since a pair may be given to other colors long before its lines are
+ * drawn again. When all the views' scrollback
+ * together goes over HISTORY_BUDGET bytes, the oldest lines of the views
+ * that have been quiet longest are dropped first.
+ *
+ * Lines dropped from memory are spilled, while there's room, to files in
+ * spilldir: append-only segments of length-prefixed packed lines, the
+ * first nspill lines of the scrollback. A segment is only mapped in when
+ * a scrolled-back view (or a search) needs a line from it, and the files
+ * are unlinked as soon as they're created, so they disappear with mtm.
+ *
+ * Lines are also numbered from when the view was created; hbase is the
+ * number of the oldest line still kept. For searching, each block of
+ * BLOCKLINES lines has a bloom filter of the trigrams in its lines' text,
+ * so that blocks that can't contain a match are skipped without being
+ * looked at, wherever their lines are kept.
+ */
+static int
+toutf8(wchar_t w, char *b) /* Encode w into b, returning its length. */
+{
+    unsigned long c = (unsigned long)w;
+    if (c < 0x80)
+        return b[0] = (char)c, 1;
+    if (c < 0x800)
+        return b[0] = (char)(0xc0 | c >> 6), b[1] = (char)(0x80 | (c & 0x3f)), 2;
+    if (c < 0x10000){
+        b[0] = (char)(0xe0 | c >> 12);
+        b[1] = (char)(0x80 | (c >> 6 & 0x3f));
+        b[2] = (char)(0x80 | (c & 0x3f));
+        return 3;
+    }
+    b[0] = (char)(0xf0 | (c >> 18 & 0x07));
+    b[1] = (char)(0x80 | (c >> 12 & 0x3f));
+    b[2] = (char)(0x80 | (c >> 6 & 0x3f));
+    b[3] = (char)(0x80 | (c & 0x3f));
+    return 4;
+}
 
-HANDLER(decid) /* DECID - Send Terminal Identification */
-    if (w == L'c')
-        SEND(n, iw == L'>'? "\033[>1;10;0c" : "\033[?1;2c");
-    else if (w == L'Z')
-        SEND(n, "\033[?6c");
-ENDHANDLER
+static int
+fromutf8(const char *s, wchar_t *w) /* Decode the character at s. */
+{
+    const unsigned char *u = (const unsigned char *)s;
+    int k = u[0] < 0x80? 0 : u[0] < 0xe0? 1 : u[0] < 0xf0? 2 : 3;
+    unsigned long c = k? u[0] & (0x3f >> k) : u[0];
+    for (int i = 1; i <= k; i++)
+        c = c << 6 | (u[i] & 0x3f);
+    *w = (wchar_t)c;
+    return k + 1;
+}
 
-HANDLER(hpa) /* HPA - Cursor Horizontal Absolute */
-    wmove(win, py, MIN(P1(0) - 1, mx - 1));
-ENDHANDLER
+static const wchar_t *
+cellparts(const cchar_t *c, wchar_t *b, attr_t *a, int *p) /* Take a cell apart. */
+{
+#if CELLFIELDS
+    (void)b;
+    *a = c->attr & A_ATTRIBUTES & ~A_COLOR;
+    #if NCURSES_EXT_COLORS
+        *p = c->ext_color;
+    #else
+        *p = PAIR_NUMBER(c->attr);
+    #endif
+    return c->chars;
+#else
+    short s = 0;
+    *p = 0;
+    memset(b, 0, (CCHARW_MAX + 1) * sizeof(wchar_t));
+    #if NCURSES_EXT_COLORS
+        getcchar(c, b, a, &s, p);
+    #else
+        getcchar(c, b, a, &s, NULL);
+        *p = s;
+    #endif
+    *a &= A_ATTRIBUTES & ~A_COLOR;
+    return b;
+#endif
+}
 
-HANDLER(hpr) /* HPR - Cursor Horizontal Relative */
-    wmove(win, py, MIN(px + P1(0), mx - 1));
-ENDHANDLER
+static void
+makecell(cchar_t *c, const wchar_t *w, attr_t a, int p) /* Put a cell together. */
+{
+#if NCURSES_EXT_COLORS
+    setcchar(c, w, a, 0, &p);
+#else
+    setcchar(c, w, a, (short)p, NULL);
+#endif
+}
 
-HANDLER(vpa) /* VPA - Cursor Vertical Absolute */
-    wmove(win, MIN(tos + bot - 1, MAX(tos + top, tos + P1(0) - 1)), x);
-ENDHANDLER
+static void
+restyle(cchar_t *c, attr_t flip, attr_t set) /* Change a cell's attributes. */
+{
+#if CELLFIELDS
+    c->attr = (c->attr ^ flip) | set;
+#else
+    wchar_t w[CCHARW_MAX + 1];
+    attr_t a;
+    int p;
+    cellparts(c, w, &a, &p);
+    makecell(c, w, (a ^ flip) | set, p);
+#endif
+}
 
-HANDLER(vpr) /* VPR - Cursor Vertical Relative */
-    wmove(win, MIN(tos + bot - 1, MAX(tos + top, py + P1(0))), x);
-ENDHANDLER
+static size_t
+linesize(const LINE *l) /* Bytes used by a packed line. */
+{
+    return sizeof(LINE) + l->nspans * sizeof(SPAN) + l->ntext;
+}
 
-HANDLER(cbt) /* CBT - Cursor Backwards Tab */
-    for (int i = x - 1; i < n->ntabs && i >= 0; i--) if (n->tabs[i]){
-        wmove(win, py, i);
-        return;
+static bool
+packroom(PACKING *k, int n) /* Make room in k for a line of n cells. */
+{
+    if (n > k->cap){
+        SPAN *ns = realloc(k->spans, n * sizeof(SPAN));
+        char *nt = ns? realloc(k->text, n * CCHARW_MAX * 4) : NULL;
+        k->spans = ns? ns : k->spans;
+        k->text = nt? nt : k->text;
+        if (!ns || !nt)
+            return false;
+        k->cap = n;
     }
-    wmove(win, py, 0);
-ENDHANDLER
+    return true;
+}
 
-HANDLER(ht) /* HT - Horizontal Tab */
-    for (int i = x + 1; i < n->w && i < n->ntabs; i++) if (n->tabs[i]){
-        wmove(win, py, i);
-        return;
+static void
+packcell(PACKING *k, const wchar_t *wch, attr_t a, int pair) /* Add a cell to k. */
+{
+    int fg = pair? pairs[pair].fg : -1, bg = pair? pairs[pair].bg : -1;
+    SPAN *p = k->nspans? &k->spans[k->nspans - 1] : NULL;
+    if (p && p->attr == a && p->fg == fg && p->bg == bg)
+        p->n++;
+    else
+        k->spans[k->nspans++] = (SPAN){.attr = a, .fg = fg, .bg = bg, .n = 1};
+    for (int j = 0; j < CCHARW_MAX && (wch[j] || !j); j++)
+        k->ntext += toutf8(wch[j]? wch[j] : L' ', k->text + k->ntext);
+    if (wch[0] != L' ' || (CCHARW_MAX > 1 && wch[1]) || a != A_NORMAL || pair)
+        k->last = k->ncells + 1;
+    k->ncells++;
+}
+
+static LINE *
+packed(PACKING *k) /* Make a new line of what's in k, and empty it. */
+{
+    for (int i = k->last; i < k->ncells; i++){ /* plain trailing blanks are one byte */
+        k->ntext--;
+        if (!--k->spans[k->nspans - 1].n)
+            k->nspans--;
     }
-    wmove(win, py, mx - 1);
-ENDHANDLER
 
-HANDLER(tab) /* Tab forwards or backwards */
-    for (int i = 0; i < P1(0); i++) switch (w){
-        case L'I':  CALL(ht);  break;
-        case L'\t': CALL(ht);  break;
-        case L'Z':  CALL(cbt); break;
+    LINE *l = malloc(sizeof(LINE) + k->nspans * sizeof(SPAN) + k->ntext);
+    if (l){
+        l->nspans = k->nspans;
+        l->ntext = k->ntext;
+        memcpy(l->spans, k->spans, k->nspans * sizeof(SPAN));
+        memcpy(LINETEXT(l), k->text, k->ntext);
     }
-ENDHANDLER
+    k->nspans = k->ntext = k->ncells = k->last = 0;
+    return l;
+}
 
-HANDLER(decaln) /* DECALN - Screen Alignment Test */
-    chtype e[] = {COLOR_PAIR(0) | 'E', 0};
-    for (int r = 0; r < my; r++){
-        for (int c = 0; c <= mx; c++)
-            mvwaddchnstr(win, tos + r, c, e, 1);
+static LINE *
+pack(const cchar_t *c, int n) /* Pack n cells into a new line. */
+{
+    static PACKING k;
+    if (!packroom(&k, n))
+        return NULL;
+    for (int i = 0; i < n; i++){
+        wchar_t b[CCHARW_MAX + 1];
+        attr_t a;
+        int pair;
+        const wchar_t *wch = cellparts(&c[i], b, &a, &pair);
+        packcell(&k, wch, a, pair);
     }
-    wmove(win, py, px);
-ENDHANDLER
+    return packed(&k);
+}
 
-HANDLER(su) /* SU - Scroll Up/Down */
-    wscrl(win, (w == L'T' || w == L'^')? -P1(0) : P1(0));
-ENDHANDLER
+static int
+unpack(const LINE *l, cchar_t *c, int n) /* Unpack up to n cells of l. */
+{
+    const char *t = LINETEXT(l), *e = t + l->ntext;
+    int k = 0;
+    for (int i = 0; i < l->nspans && k < n; i++){
+        const SPAN *s = &l->spans[i];
+        int pair = colorpair(fitcolor(s->fg), fitcolor(s->bg));
+        for (int j = 0; j < s->n && k < n; j++){
+            wchar_t wch[CCHARW_MAX + 1] = {0};
+            int m = 0;
+            t += fromutf8(t, &wch[m++]);
+            while (t < e && m < CCHARW_MAX){ /* combining characters */
+                wchar_t x;
+                int b = fromutf8(t, &x);
+                if (wcwidth(x) != 0)
+                    break;
+                wch[m++] = x;
+                t += b;
+            }
+            makecell(&c[k++], wch, s->attr, pair);
+        }
+    }
+    return k;
+}
 
-HANDLER(sc) /* SC - Save Cursor */
-    s->sx = px;                              /* save X position            */
-    s->sy = py;                              /* save Y position            */
-    wattr_get(win, &s->sattr, &s->sp, NULL); /* save attrs and color pair  */
-    s->sfg = s->fg;                          /* save foreground color      */
-    s->sbg = s->bg;                          /* save background color      */
-    s->oxenl = s->xenl;                      /* save xenl state            */
-    s->saved = true;                         /* save data is valid         */
-    n->sgc = n->gc; n->sgs = n->gs;          /* save character sets        */
-ENDHANDLER
+static LINE *
+histline(NODE *n, int i) /* Get the ith oldest line of n's scrollback. */
+{
+    return n->hist[(n->hhead + i) % n->hcap];
+}
 
-HANDLER(rc) /* RC - Restore Cursor */
-    if (iw == L'#'){
-        CALL(decaln);
-        return;
-    }
+static void
+unmapspill(NODE *n) /* Release n's mapped segments. */
+{
+    for (int i = 0; i < n->nsegs; i++) if (n->segs[i].map){
+        munmap(n->segs[i].map, n->segs[i].size);
+        free(n->segs[i].index);
+        n->segs[i].map = NULL;
+        n->segs[i].index = NULL;
+    }
+}
+
+static uint32_t
+fold(uint32_t g, char c) /* Shift c, in lower case if ASCII, into trigram g. */
+{
+    unsigned char u = (unsigned char)c;
+    return (g << 8 | ((unsigned)u - 'A' < 26u? u | 0x20 : u)) & 0xffffff;
+}
+
+static unsigned
+hashtrigram(uint32_t g) /* Pick g's bit in a bloom filter. */
+{
+    return (uint32_t)(g * 2654435761u) >> (32 - BLOOMLOG);
+}
+
+static unsigned
+trigram(const char *t) /* Hash the trigram at t, ignoring ASCII case. */
+{
+    return hashtrigram(fold(fold(fold(0, t[0]), t[1]), t[2]));
+}
+
+static void
+bloomadd(NODE *n, long line, const LINE *l) /* Index the text of a line. */
+{
+    long b = line / BLOCKLINES;
+    if (!n->nblooms)
+        n->bloom0 = b;
+    while (b >= n->bloom0 + n->nblooms){
+        if (n->nblooms == n->bcap){
+            BLOOM *f = realloc(n->bloom, (n->bcap * 2 + 16) * sizeof(BLOOM));
+            if (!f)
+                return;
+            n->bloom = f;
+            n->bcap = n->bcap * 2 + 16;
+        }
+        memset(n->bloom[n->nblooms++], 0, sizeof(BLOOM));
+    }
+
+    uint64_t *f = n->bloom[b - n->bloom0];
+    const char *t = LINETEXT(l);
+    uint32_t g = l->ntext < 3? 0 : fold(fold(0, t[0]), t[1]);
+    for (int i = 2; i < l->ntext; i++){
+        unsigned h = hashtrigram(g = fold(g, t[i]));
+        f[h / 64] |= (uint64_t)1 << (h % 64);
+    }
+}
+
+static bool
+bloomhas(NODE *n, long b, const unsigned *h, int nh) /* Might block b match? */
+{
+    if (b < n->bloom0 || b >= n->bloom0 + n->nblooms)
+        return true;
+    for (int i = 0; i < nh; i++)
+        if (!(n->bloom[b - n->bloom0][h[i] / 64] & (uint64_t)1 << (h[i] % 64)))
+            return false;
+    return true;
+}
+
+static void
+forget(NODE *n, long k) /* Note that n's k oldest lines are gone. */
+{
+    long dead = (n->hbase += k) / BLOCKLINES - n->bloom0;
+    if (n->nblooms && dead >= MIN(n->nblooms, 64)){ /* drop dead blocks */
+        dead = MIN(dead, n->nblooms);
+        memmove(n->bloom, n->bloom + dead, (n->nblooms - dead) * sizeof(BLOOM));
+        n->nblooms -= (int)dead;
+        n->bloom0 += dead;
+    }
+}
+
+static void
+dropsegment(NODE *n) /* Forget n's oldest spilled lines. */
+{
+    unmapspill(n);
+    forget(n, n->segs[0].nlines);
+    n->nspill -= n->segs[0].nlines;
+    n->spillsize -= n->segs[0].size;
+    fclose(n->segs[0].f);
+    memmove(n->segs, n->segs + 1, --n->nsegs * sizeof(SEGMENT));
+}
+
+static bool
+spill(NODE *n, const LINE *l) /* Append l to n's newest segment. */
+{
+    static const char pad[4];
+    SEGMENT *g = n->nsegs? n->segs + n->nsegs - 1 : NULL;
+    size_t z = linesize(l);
+    uint32_t len = (uint32_t)((z + 3) & ~(size_t)3); /* keep lines aligned */
+    if (!spilldir || !*spilldir || SPILL_LIMIT <= 0)
+        return false;
+
+    if (!g || g->size + sizeof(len) + len > SEGMENT_SIZE){
+        char path[PATH_MAX] = {0};
+        SEGMENT *s = realloc(n->segs, (n->nsegs + 1) * sizeof(SEGMENT));
+        if (!s)
+            return false;
+        n->segs = s;
+        g = s + n->nsegs;
+        *g = (SEGMENT){0};
+        snprintf(path, sizeof(path) - 1, "%s/mtm-XXXXXX", spilldir);
+        int fd = mkstemp(path);
+        if (fd < 0)
+            return false;
+        unlink(path);
+        if (!(g->f = fdopen(fd, "w+")))
+            return close(fd), false;
+        n->nsegs++;
+    }
+
+    if (fwrite(&len, sizeof(len), 1, g->f) != 1 || fwrite(l, z, 1, g->f) != 1
+     || (len > z && fwrite(pad, len - z, 1, g->f) != 1)){
+        while (n->nsegs) /* the segment's no good now; start over */
+            dropsegment(n);
+        return false;
+    }
+    g->nlines++;
+    g->size += sizeof(len) + len;
+    n->nspill++;
+    n->spillsize += sizeof(len) + len;
+    while (n->spillsize > SPILL_LIMIT && n->nsegs > 1)
+        dropsegment(n);
+    return true;
+}
+
+static const LINE *
+spilled(NODE *n, int i) /* Get the ith oldest spilled line of n. */
+{
+    SEGMENT *g = n->segs;
+    while (i >= g->nlines)
+        i -= g++->nlines;
+
+    if (!g->map || i >= g->nmapped){ /* map in just this segment */
+        unmapspill(n);
+        if (fflush(g->f) != 0 || !(g->index = malloc(g->nlines * sizeof(uint32_t))))
+            return NULL;
+        g->map = mmap(NULL, g->size, PROT_READ, MAP_SHARED, fileno(g->f), 0);
+        if (g->map == MAP_FAILED){
+            g->map = NULL;
+            free(g->index);
+            g->index = NULL;
+            return NULL;
+        }
+        size_t o = 0;
+        for (int k = 0; k < g->nlines; k++){
+            uint32_t len;
+            memcpy(&len, g->map + o, sizeof(len));
+            g->index[k] = (uint32_t)(o + sizeof(len));
+            o += sizeof(len) + len;
+        }
+        g->nmapped = g->nlines;
+    }
+    return (const LINE *)(g->map + g->index[i]);
+}
+
+static const LINE *
+histget(NODE *n, int i) /* Get the ith oldest line of n's scrollback. */
+{
+    return i < n->nspill? spilled(n, i) : histline(n, i - n->nspill);
+}
+
+static int
+histsize(NODE *n) /* Count the lines of n's scrollback. */
+{
+    return n->nspill + n->hlen;
+}
+
+static void
+histdrop(NODE *n) /* Drop the oldest line of n's scrollback from memory. */
+{
+    LINE *l = histline(n, 0);
+    bool kept = spill(n, l);
+    n->hbytes -= linesize(l);
+    histbytes -= linesize(l);
+    free(l);
+    n->hhead = (n->hhead + 1) % n->hcap;
+    n->hlen--;
+    if (!kept){
+        forget(n, 1);
+        n->pri.off = MIN(n->pri.off, histsize(n));
+    }
+}
+
+static void
+histclear(NODE *n) /* Forget n's scrollback. */
+{
+    for (int i = 0; i < n->hlen; i++){
+        histbytes -= linesize(histline(n, i));
+        free(histline(n, i));
+    }
+    n->hbytes = 0;
+    while (n->nsegs)
+        dropsegment(n);
+    forget(n, n->hlen);
+    n->hlen = n->hhead = n->pri.off = 0;
+}
+
+static NODE *
+idlest(NODE *n) /* Find the quietest view under n with scrollback. */
+{
+    if (!n)
+        return NULL;
+    if (n->t == VIEW)
+        return n->hlen? n : NULL;
+    NODE *a = idlest(n->c1), *b = idlest(n->c2);
+    return !a? b : !b? a : a->active <= b->active? a : b;
+}
+
+static NODE *
+idlestview(void) /* Find the quietest view with scrollback in any window. */
+{
+    NODE *n = idlest(root);
+    for (int i = 0; i < nwins; i++) if (i != curwin){
+        NODE *m = idlest(wins[i].root);
+        n = !n? m : m && m->active < n->active? m : n;
+    }
+    return n;
+}
+
+static void
+histbudget(void) /* Drop old scrollback until it fits in the budget. */
+{
+    size_t target = HISTORY_BUDGET - HISTORY_BUDGET / 16; /* some headroom */
+    NODE *n = NULL;
+    if (histbytes > HISTORY_BUDGET)
+        while (histbytes > target && (n = idlestview()))
+            while (n->hlen && histbytes > target)
+                histdrop(n);
+}
+
+static cchar_t *
+cells(int n) /* Get a scratch buffer of at least n cells. */
+{
+    static cchar_t *buf;
+    static int cap;
+    if (n > cap){
+        cchar_t *b = realloc(buf, n * sizeof(cchar_t));
+        if (!b)
+            return NULL;
+        buf = b;
+        cap = n;
+    }
+    return buf;
+}
+
+static LINE *
+rowline(WINDOW *win, int row) /* Pack a row of a pad into a new line. */
+{
+    int y, x, k = 0, w = getmaxx(win), p;
+    wchar_t b[CCHARW_MAX + 1];
+    attr_t a;
+    cchar_t *c = cells(w + 1);
+    if (!c)
+        return NULL;
+    getyx(win, y, x);
+    mvwin_wchnstr(win, row, 0, c, w); /* wide chars take one cell */
+    wmove(win, y, x);
+    while (k < w && cellparts(&c[k], b, &a, &p)[0])
+        k++;
+    return pack(c, k);
+}
+
+static void
+histadd(NODE *n, LINE *l) /* Add a line to the end of n's scrollback. */
+{
+    if (n->hmax <= 0 || !l){
+        free(l);
+        return;
+    }
+
+    if (n->hlen == n->hcap && n->hcap < n->hmax){ /* grow the ring */
+        int cap = MIN(n->hmax, n->hcap * 2 + 64);
+        LINE **h = malloc(cap * sizeof(LINE *));
+        for (int i = 0; h && i < n->hlen; i++)
+            h[i] = histline(n, i);
+        if (h){
+            free(n->hist);
+            n->hist = h;
+            n->hcap = cap;
+            n->hhead = 0;
+        }
+    }
+
+    if (!n->hcap){
+        free(l);
+        return;
+    }
+    if (n->hlen == n->hcap)
+        histdrop(n);
+    bloomadd(n, n->hbase + histsize(n), l);
+    n->hist[(n->hhead + n->hlen++) % n->hcap] = l;
+    n->hbytes += linesize(l);
+    histbytes += linesize(l);
+    if (n->pri.off)
+        n->pri.off = MIN(n->pri.off + 1, histsize(n));
+    histbudget();
+}
+
+static void
+histpush(NODE *n, int row) /* Save a row of n's primary screen. */
+{
+    if (n->hmax > 0)
+        histadd(n, rowline(n->pri.win, row));
+}
+
+static void
+compact(NODE *n) /* Move n's primary screen back to the top of its pad. */
+{
+    SCRN *s = &n->pri;
+    int y, x, top = 0, bot = 0;
+    getyx(s->win, y, x);
+    wgetscrreg(s->win, &top, &bot);
+    wsetscrreg(s->win, 0, getmaxy(s->win) - 1);
+    wscrl(s->win, s->tos);
+    wsetscrreg(s->win, top - s->tos, bot - s->tos);
+    wmove(s->win, y - s->tos, x);
+    s->tos = 0;
+}
+
+static void
+advance(NODE *n) /* Scroll n's primary screen up a line. */
+{
+    SCRN *s = &n->pri;
+    int y, x, top = 0, bot = 0;
+    histpush(n, s->tos);
+    n->scrolled += n->scrolled < INT_MAX;
+    n->st.scrolls++;
+    if (s->tos + n->h >= getmaxy(s->win))
+        compact(n);
+
+    getyx(s->win, y, x);
+    wgetscrreg(s->win, &top, &bot);
+    s->tos++;
+    wsetscrreg(s->win, top + 1, bot + 1);
+    wmove(s->win, s->tos + n->h - 1, 0);
+    wclrtoeol(s->win);
+    wmove(s->win, y + 1, x);
+}
+
+/*** JUMP SCROLLING
+ * While a view jump scrolls, the rows its program writes at the bottom of
+ * the screen and scrolls away are packed as they're written, rather than
+ * being written to the pad and packed again when they reach the top: once
+ * a screenful of them has gone by, each goes from the parser straight to
+ * the scrollback and the pad isn't touched at all. Runs of narrow text,
+ * tabs, SGR, erasing to the end of the row, and newlines keep a row out of
+ * the pad; anything else, and the end of every read, settles the rows still
+ * on the screen back into it, so it is only ever behind while the parser
+ * runs. A jump that settles before a row has gone straight by costs more
+ * than it saves, so the view isn't given another until its next read.
+ */
+static struct{
+    NODE *n;            /* the view whose rows are kept out, if any */
+    PACKING row;        /* its cursor row, as written so far */
+    attr_t fa;          /* the attributes and pair of the blanks after it */
+    int fp;
+    LINE **lines;       /* rows scrolled up from it, a ring of up to h - 1 */
+    int cap, head, len;
+    NODE *no;           /* the last view and row that couldn't be kept out */
+    int norow;
+    NODE *shy;          /* a view this read whose rows all went to its pad */
+} jump;
+
+static void
+penparts(WINDOW *win, attr_t *a, int *p) /* Get what win writes text with. */
+{
+    short s = 0;
+    *p = 0;
+#if NCURSES_EXT_COLORS
+    wattr_get(win, a, &s, p);
+#else
+    wattr_get(win, a, &s, NULL);
+    *p = s;
+#endif
+    *a &= A_ATTRIBUTES & ~A_COLOR;
+}
+
+static void
+setpen(WINDOW *win, attr_t a, int p) /* Set what win writes text with. */
+{
+#if NCURSES_EXT_COLORS
+    wattr_set(win, a, 0, &p);
+#else
+    wattr_set(win, a, (short)p, NULL);
+#endif
+}
+
+static void
+jumpfill(int x) /* Fill a kept-out row with blanks up to x. */
+{
+    while (jump.row.ncells < x)
+        packcell(&jump.row, L" ", jump.fa, jump.fp);
+}
+
+static bool
+startjump(NODE *n) /* Start keeping n's cursor row out of its pad. */
+{
+    WINDOW *win = n->pri.win;
+    int y, x, w = getmaxx(win), p;
+    wchar_t b[CCHARW_MAX + 1];
+    attr_t a;
+    cchar_t *c = cells(w);
+    getyx(win, y, x);
+    if (!c || jump.shy == n || (jump.no == n && jump.norow == y)
+        || !packroom(&jump.row, w))
+        return false;
+    if (jump.cap < n->h){
+        LINE **l = realloc(jump.lines, n->h * sizeof(LINE *));
+        if (!l)
+            return false;
+        jump.lines = l;
+        jump.cap = n->h;
+    }
+
+    mvwin_wchnstr(win, y, 0, c, w); /* only a blank row can be packed anew */
+    wmove(win, y, x);
+    cellparts(&c[0], b, &jump.fa, &jump.fp);
+    for (int i = 0; i < w; i++){
+        const wchar_t *wch = cellparts(&c[i], b, &a, &p);
+        if (wch[0] != L' ' || (CCHARW_MAX > 1 && wch[1])
+            || a != jump.fa || p != jump.fp){
+            jump.no = n;
+            jump.norow = y;
+            return false;
+        }
+    }
+
+    jump.n = n;
+    jumpfill(x);
+    return true;
+}
+
+static void
+jumptext(WINDOW *win, int x, const wchar_t *t, int k) /* Add to a kept-out row. */
+{
+    wchar_t b[CCHARW_MAX + 1];
+    attr_t a, ba;
+    int p, bp;
+    cchar_t c;
+    penparts(win, &a, &p);
+    wgetbkgrnd(win, &c); /* as ncurses renders it */
+    cellparts(&c, b, &ba, &bp);
+    a |= ba;
+    p = p? p : bp;
+    jumpfill(x); /* it might have been tabbed to */
+    for (int i = 0; i < k; i++)
+        packcell(&jump.row, (wchar_t[]){t[i], 0}, a, p);
+}
+
+static void
+jumperase(WINDOW *win, int x) /* Clear a kept-out row from x on. */
+{
+    wchar_t b[CCHARW_MAX + 1];
+    cchar_t c;
+    jumpfill(x);
+    wgetbkgrnd(win, &c); /* what wclrtoeol() leaves */
+    cellparts(&c, b, &jump.fa, &jump.fp);
+}
+
+static LINE *
+jumprow(int w) /* Pack a kept-out row, blanks and all. */
+{
+    jumpfill(w);
+    return packed(&jump.row);
+}
+
+static void
+jumpline(NODE *n) /* Scroll n's screen up past a kept-out row. */
+{
+    WINDOW *win = n->pri.win;
+    int x = getcurx(win);
+    LINE *l = jumprow(getmaxx(win));
+    if (jump.len < n->h - 1){ /* the top row is still one of the pad's */
+        advance(n);
+        jump.lines[jump.len++] = l;
+    } else{ /* it was kept out too, so it goes straight by */
+        n->scrolled += n->scrolled < INT_MAX;
+        n->st.scrolls++;
+        if (jump.len){
+            histadd(n, jump.lines[jump.head]);
+            jump.lines[jump.head] = l;
+            jump.head = (jump.head + 1) % jump.len;
+        } else
+            histadd(n, l);
+    }
+
+    jumperase(win, 0); /* the new row is cleared to the background */
+    jumpfill(x);
+}
+
+static void
+putrow(WINDOW *win, int row, const LINE *l) /* Write a line over a row of a pad. */
+{
+    int w = getmaxx(win), k = 0;
+    cchar_t *c = cells(w);
+    if (!c)
+        return;
+    if (l)
+        k = unpack(l, c, w);
+    while (k < w)
+        makecell(&c[k++], L" ", A_NORMAL, 0);
+    mvwadd_wchnstr(win, row, 0, c, w);
+}
+
+static void
+settle(NODE *n) /* Put the rows kept out of n's pad back into it. */
+{
+    if (jump.n != n)
+        return;
+
+    WINDOW *win = n->pri.win;
+    int y, x, p;
+    attr_t a;
+    cchar_t bg, plain;
+    getyx(win, y, x);
+    penparts(win, &a, &p);
+    wgetbkgrnd(win, &bg);
+    makecell(&plain, L" ", A_NORMAL, 0);
+    wbkgrndset(win, &plain); /* so that the cells are written as they are */
+    setpen(win, A_NORMAL, 0);
+    for (int i = 0; i < jump.len; i++){
+        LINE *l = jump.lines[(jump.head + i) % jump.len];
+        putrow(win, y - jump.len + i, l);
+        free(l);
+    }
+    LINE *l = jumprow(getmaxx(win));
+    putrow(win, y, l);
+    free(l);
+    wbkgrndset(win, &bg);
+    setpen(win, a, p);
+    wmove(win, y, x);
+
+    touch(n, n->h - 1 - jump.len, n->h - 1);
+    if (jump.len < n->h - 1)
+        jump.shy = n; /* it cost more than it saved */
+    jump.n = NULL;
+    jump.len = jump.head = 0;
+}
+
+/*** SEARCH
+ * A search looks through a view's scrollback, and then its screen, for a
+ * literal string or an extended regular expression, either ignoring case
+ * if the query has no capitals in it. Lines are numbered as they are in
+ * the scrollback, with the rows of the screen following the last saved
+ * line, and the current match is kept by absolute line number so that it
+ * stays put as new lines arrive. Blocks of lines whose bloom filters lack
+ * one of the trigrams every match must contain are skipped unread.
+ */
+static struct{
+    NODE *n;                /* the view being searched, if any */
+    bool regex, fold, bad;  /* is it a regex; ignoring case; won't compile */
+    int nq, ng, dir;        /* query length; number of trigrams; direction */
+    wchar_t q[MAXQUERY + 1];
+    char u[MAXQUERY * 4 + 1];   /* the query in (folded) UTF-8 */
+    unsigned g[MAXQUERY];       /* trigrams of what every match contains */
+    regex_t re;
+    long match, origin;     /* absolute lines of the match and the start */
+    int ms, me, origoff;    /* bytes of the match; the original scroll */
+    int px;                 /* where the cursor goes in the prompt */
+    bool compiled;
+    const char *status;
+} search;
+
+static int
+nextchar(const char *t, int i) /* Find the character after the one at t[i]. */
+{
+    do i++; while ((t[i] & 0xc0) == 0x80);
+    return i;
+}
+
+static int
+literal(const char *r, char *lit) /* Find a literal run every match of r has. */
+{
+    int best = 0, len = 0, depth = 0;
+    const char *start = r;
+    if (strchr(r, '|'))
+        return 0;
+    for (const char *p = r; *p; p++){
+        unsigned char c = *p;
+        if (depth || strchr(".[]()*+?{}^$\\", c) || (c >= 0x80 && search.fold)){
+            len = 0;
+            if (c == '\\' && p[1])
+                p++;
+            else if (c == '('  || c == ')')
+                depth = MAX(0, depth + (c == '('? 1 : -1));
+            else if (c == '['){ /* skip the bracket expression */
+                p += p[1] == '^'? 2 : 1;
+                p += *p == ']';
+                while (*p && *p != ']')
+                    p++;
+                if (!*p)
+                    break;
+            }
+            continue;
+        }
+
+        int k = nextchar(p, 0);
+        if (p[k] == '*' || p[k] == '?' || p[k] == '{'){ /* optional */
+            len = 0;
+            p += k - 1;
+            continue;
+        }
+        if (!len)
+            start = p;
+        len += k;
+        if (len > best)
+            memcpy(lit, start, best = len);
+        if (p[k] == '+') /* the run can't continue past a repetition */
+            len = 0;
+        p += k - 1;
+    }
+    return best;
+}
+
+static void
+setquery(void) /* Prepare the query for searching. */
+{
+    char lit[sizeof(search.u)];
+    int nu = 0, nl;
+
+    search.q[search.nq] = 0;
+    search.fold = true;
+    for (int i = 0; i < search.nq; i++){
+        search.fold = search.fold && !iswupper(search.q[i]);
+        nu += toutf8(search.q[i], search.u + nu);
+    }
+    search.u[nu] = 0;
+    if (search.fold && !search.regex)
+        for (int i = 0; i < nu; i++)
+            search.u[i] = (char)tolower((unsigned char)search.u[i]);
+
+    if (search.compiled)
+        regfree(&search.re);
+    search.compiled = search.regex && nu && !regcomp(&search.re, search.u,
+                              REG_EXTENDED | (search.fold? REG_ICASE : 0));
+    search.bad = search.regex && !search.compiled;
+    if (search.regex)
+        nl = search.compiled? literal(search.u, lit) : 0;
+    else
+        memcpy(lit, search.u, nl = nu);
+
+    search.ng = 0;
+    for (int i = 0; i + 2 < nl && search.ng < MAXQUERY; i++)
+        search.g[search.ng++] = trigram(lit + i);
+}
+
+static const char *
+linetext(const LINE *l) /* Get l's text as a string, folded if need be. */
+{
+    static char *buf;
+    static int size;
+    if (l->ntext >= size){
+        char *b = realloc(buf, l->ntext + 1);
+        if (!b)
+            return "";
+        buf = b;
+        size = l->ntext + 1;
+    }
+    memcpy(buf, LINETEXT(l), l->ntext);
+    buf[l->ntext] = 0;
+    if (search.fold && !search.regex)
+        for (int i = 0; i < l->ntext; i++)
+            buf[i] = (char)tolower((unsigned char)buf[i]);
+    return buf;
+}
+
+static bool
+matchfrom(const char *t, int from, int *s, int *e) /* Find a match at/after from. */
+{
+    regmatch_t m;
+    if (search.bad || !search.nq)
+        return false;
+    if (!search.regex){
+        const char *p = strstr(t + from, search.u);
+        if (p){
+            *s = (int)(p - t);
+            *e = *s + (int)strlen(search.u);
+        }
+        return p;
+    }
+    while (regexec(&search.re, t + from, 1, &m, from? REG_NOTBOL : 0) == 0){
+        if (m.rm_eo > m.rm_so){
+            *s = from + (int)m.rm_so;
+            *e = from + (int)m.rm_eo;
+            return true;
+        }
+        if (!t[from + m.rm_so]) /* only ever empty matches */
+            return false;
+        from = nextchar(t, from + (int)m.rm_so);
+    }
+    return false;
+}
+
+static bool
+linefind(const LINE *l, int at, int dir, int *s, int *e) /* Search a line. */
+{
+    const char *t = linetext(l);
+    int ms, me;
+    bool found = false;
+    if (dir > 0){ /* the first match starting at or after at */
+        while (at < l->ntext && (t[at] & 0xc0) == 0x80)
+            at++;
+        return at <= l->ntext && matchfrom(t, at, s, e);
+    }
+    for (int from = 0; from < at && matchfrom(t, from, &ms, &me) && ms < at;
+         from = nextchar(t, ms)){ /* the last match starting before at */
+        *s = ms;
+        *e = me;
+        found = true;
+    }
+    return found;
+}
+
+static int
+cellsbefore(const LINE *l, int off) /* Find the cell holding byte off of l. */
+{
+    const char *t = LINETEXT(l);
+    int k = 0;
+    for (int i = 0; i < off && i < l->ntext; ){
+        wchar_t w;
+        int b = fromutf8(t + i, &w);
+        if (!i || wcwidth(w) != 0) /* combining characters share a cell */
+            k++;
+        i += b;
+    }
+    return k;
+}
+
+static const LINE *
+textline(NODE *n, int i, LINE **tmp) /* Get line i of n's history and screen. */
+{
+    int hs = histsize(n);
+    *tmp = i < hs? NULL : rowline(n->pri.win, n->pri.tos + i - hs);
+    return i < hs? histget(n, i) : *tmp;
+}
+
+static bool
+findmatch(NODE *n, long line, int at, int dir) /* Find the next match. */
+{
+    int hs = histsize(n), total = hs + n->h;
+    for (long i = MAX(line - n->hbase, -1); i >= 0 && i < total;
+         i += dir, at = dir > 0? 0 : INT_MAX){
+        long b = (n->hbase + i) / BLOCKLINES;
+        if (i < hs && !bloomhas(n, b, search.g, search.ng)){
+            b = b * BLOCKLINES - n->hbase; /* skip the rest of the block */
+            i = dir > 0? MIN(b + BLOCKLINES, hs) - 1 : b;
+            continue;
+        }
+
+        LINE *tmp;
+        const LINE *l = textline(n, (int)i, &tmp);
+        int s, e;
+        bool found = l && linefind(l, at, dir, &s, &e);
+        free(tmp);
+        if (found){
+            search.match = n->hbase + i;
+            search.ms = s;
+            search.me = e;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*** TERMINAL EMULATION HANDLERS
+ * These functions implement the various terminal commands activated by
+ * escape sequences and printing to the terminal. Large amounts of boilerplate
+ * code is shared among all these functions, and is factored out into the
+ * macros below:
+ *      PD(n, d)       - Parameter n, with default d.
+ *      P0(n)          - Parameter n, default 0.
+ *      P1(n)          - Parameter n, default 1.
+ *      SUB(n)         - Parameter n is a sub-parameter (it followed a colon).
+ *      CALL(h)        - Call handler h with no arguments.
+ *      SENDN(n, s, c) - Queue c bytes of s to be written to n's host.
+ *      SEND(n, s)     - Queue string s to be written to n's host.
+ *      DIRTY(a, b)    - Rows a through b of the screen need redrawing.
+ *      (END)HANDLER   - Declare/end a handler function
+ *      JUMPHANDLER    - Declare one that doesn't settle kept-out rows first
+ *      COMMONVARS     - All of the common variables for a handler.
+ *                       x, y     - cursor position
+ *                       mx, my   - max possible values for x and y
+ *                       px, py   - physical cursor position in scrollback
+ *                       n        - the current node
+ *                       win      - the current window
+ *                       top, bot - the scrolling region
+ *                       tos      - top of the screen in the pad
+ *                       s        - the current SCRN buffer
+ * The funny names for handlers are from their ANSI/ECMA/DEC mnemonics.
+ */
+#define PD(x, d) (argc <= (x) || !argv? (d) : argv[(x)])
+#define P0(x) PD(x, 0)
+#define P1(x) (!P0(x)? 1 : P0(x))
+#define SUB(x) ((x) < argc && (v->subs >> (x) & 1))
+#define CALL(x) (x)(v, n, 0, 0, 0, NULL, NULL)
+#define SENDN(n, s, c) queue(n, s, c)
+#define SEND(n, s) SENDN(n, s, strlen(s))
+#define DIRTY(a, b) touch(n, (a), (b))
+#define COMMONVARS                                                      \
+    NODE *n = (NODE *)p;                                                \
+    SCRN *s = n->s;                                                     \
+    WINDOW *win = s->win;                                               \
+    int py, px, y, x, my, mx, top = 0, bot = 0, tos = s->tos;           \
+    (void)v; (void)p; (void)w; (void)iw; (void)argc; (void)argv;        \
+    (void)win; (void)y; (void)x; (void)my; (void)mx; (void)osc;         \
+    (void)tos;                                                          \
+    getyx(win, py, px); y = py - s->tos; x = px;                        \
+    getmaxyx(win, my, mx); my = MIN(my - s->tos, n->h);                 \
+    wgetscrreg(win, &top, &bot);                                        \
+    bot++; bot -= s->tos;                                               \
+    top = top <= tos? 0 : top - tos;                                    \
+
+#define JUMPHANDLER(name)                               \
+    static void                                         \
+    name (VTPARSER *v, void *p, wchar_t w, wchar_t iw,  \
+          int argc, int *argv, const wchar_t *osc)      \
+    { COMMONVARS
+#define HANDLER(name) JUMPHANDLER(name) settle(n);
+#define ENDHANDLER n->repc = 0; } /* control sequences aren't repeated */
+
+HANDLER(bell) /* Terminal bell. */
+    beep();
+ENDHANDLER
+
+HANDLER(numkp) /* Application/Numeric Keypad Mode */
+    n->pnm = (w == L'=');
+ENDHANDLER
+
+HANDLER(vis) /* Cursor visibility */
+    s->vis = iw == L'6'? 0 : 1;
+ENDHANDLER
+
+HANDLER(cup) /* CUP - Cursor Position */
+    int r = MIN((n->decom? top : 0) + P1(0), n->decom? bot : my);
+    s->xenl = false;
+    wmove(win, tos + r - 1, MIN(P1(1), mx) - 1); /* not off the screen */
+ENDHANDLER
+
+HANDLER(dch) /* DCH - Delete Character */
+    for (int i = 0; i < P1(0); i++)
+        wdelch(win);
+    DIRTY(y, y);
+ENDHANDLER
+
+HANDLER(ich) /* ICH - Insert Character */
+    for (int i = 0; i < P1(0); i++)
+        wins_nwstr(win, L" ", 1);
+    DIRTY(y, y);
+ENDHANDLER
+
+HANDLER(cuu) /* CUU - Cursor Up */
+    wmove(win, MAX(py - P1(0), tos + top), x);
+ENDHANDLER
+
+HANDLER(cud) /* CUD - Cursor Down */
+    wmove(win, MIN(py + P1(0), tos + bot - 1), x);
+ENDHANDLER
+
+HANDLER(cuf) /* CUF - Cursor Forward */
+    wmove(win, py, MIN(x + P1(0), mx - 1));
+ENDHANDLER
+
+HANDLER(ack) /* ACK - Acknowledge Enquiry */
+    SEND(n, "\006");
+ENDHANDLER
+
+HANDLER(hts) /* HTS - Horizontal Tab Set */
+    if (x < n->ntabs && x > 0)
+        n->tabs[x] = true;
+ENDHANDLER
+
+HANDLER(ri) /* RI - Reverse Index */
+    int otop = 0, obot = 0;
+    wgetscrreg(win, &otop, &obot);
+    wsetscrreg(win, otop >= tos? otop : tos, obot);
+    y == top? wscrl(win, -1) : wmove(win, MAX(tos, py - 1), x);
+    wsetscrreg(win, otop, obot);
+    if (y == top)
+        DIRTY(top, bot - 1);
+ENDHANDLER
+
+HANDLER(decid) /* DECID - Send Terminal Identification */
+    if (w == L'c')
+        SEND(n, iw == L'>'? "\033[>1;10;0c" : "\033[?1;2c");
+    else if (w == L'Z')
+        SEND(n, "\033[?6c");
+ENDHANDLER
+
+HANDLER(hpa) /* HPA - Cursor Horizontal Absolute */
+    wmove(win, py, MIN(P1(0) - 1, mx - 1));
+ENDHANDLER
+
+HANDLER(hpr) /* HPR - Cursor Horizontal Relative */
+    wmove(win, py, MIN(px + P1(0), mx - 1));
+ENDHANDLER
+
+HANDLER(vpa) /* VPA - Cursor Vertical Absolute */
+    wmove(win, MIN(tos + bot - 1, MAX(tos + top, tos + P1(0) - 1)), x);
+ENDHANDLER
+
+HANDLER(vpr) /* VPR - Cursor Vertical Relative */
+    wmove(win, MIN(tos + bot - 1, MAX(tos + top, py + P1(0))), x);
+ENDHANDLER
+
+HANDLER(cbt) /* CBT - Cursor Backwards Tab */
+    for (int i = x - 1; i < n->ntabs && i >= 0; i--) if (n->tabs[i]){
+        wmove(win, py, i);
+        return;
+    }
+    wmove(win, py, 0);
+ENDHANDLER
+
+JUMPHANDLER(ht) /* HT - Horizontal Tab */
+    for (int i = x + 1; i < n->w && i < n->ntabs; i++) if (n->tabs[i]){
+        wmove(win, py, i);
+        return;
+    }
+    wmove(win, py, mx - 1);
+ENDHANDLER
+
+JUMPHANDLER(tab) /* Tab forwards or backwards */
+    for (int i = 0; i < P1(0); i++) switch (w){
+        case L'I':  CALL(ht);  break;
+        case L'\t': CALL(ht);  break;
+        case L'Z':  CALL(cbt); break;
+    }
+ENDHANDLER
+
+HANDLER(decaln) /* DECALN - Screen Alignment Test */
+    chtype e[] = {COLOR_PAIR(0) | 'E', 0};
+    for (int r = 0; r < my; r++){
+        for (int c = 0; c <= mx; c++)
+            mvwaddchnstr(win, tos + r, c, e, 1);
+    }
+    wmove(win, py, px);
+    DIRTY(0, my);
+ENDHANDLER
+
+HANDLER(su) /* SU - Scroll Up/Down */
+    wscrl(win, (w == L'T' || w == L'^')? -P1(0) : P1(0));
+    DIRTY(0, my);
+ENDHANDLER
+
+HANDLER(sc) /* SC - Save Cursor */
+    s->sx = px;                              /* save X position            */
+    s->sy = y;                               /* save Y position            */
+    wattr_get(win, &s->sattr, &s->sp, NULL); /* save attrs and color pair  */
+    s->sfg = s->fg;                          /* save foreground color      */
+    s->sbg = s->bg;                          /* save background color      */
+    s->oxenl = s->xenl;                      /* save xenl state            */
+    s->saved = true;                         /* save data is valid         */
+    n->sgc = n->gc; n->sgs = n->gs;          /* save character sets        */
+ENDHANDLER
+
+HANDLER(rc) /* RC - Restore Cursor */
+    if (iw == L'#'){
+        CALL(decaln);
+        return;
+    }
     if (!s->saved)
         return;
-    wmove(win, s->sy, s->sx);                /* get old position          */
-    wattr_set(win, s->sattr, s->sp, NULL);   /* get attrs and color pair  */
-    s->fg = s->sfg;                          /* get foreground color      */
-    s->bg = s->sbg;                          /* get background color      */
-    s->xenl = s->oxenl;                      /* get xenl state            */
-    n->gc = n->sgc; n->gs = n->sgs;          /* save character sets        */
+    wmove(win, tos + s->sy, s->sx);          /* get old position          */
+    wattr_set(win, s->sattr, s->sp, NULL);   /* get attrs and color pair  */
+    s->fg = s->sfg;                          /* get foreground color      */
+    s->bg = s->sbg;                          /* get background color      */
+    s->xenl = s->oxenl;                      /* get xenl state            */
+    n->gc = n->sgc; n->gs = n->sgs;          /* save character sets        */
+
+    /* restore colors */
+    int cp = colorpair(s->fg, s->bg);
+    wcolor_set(win, cp, NULL);
+    cchar_t c;
+    setcchar(&c, L" ", A_NORMAL, cp, NULL);
+    wbkgrndset(win, &c);
+ENDHANDLER
+
+HANDLER(tbc) /* TBC - Tabulation Clear */
+    switch (P0(0)){
+        case 0: n->tabs[x < n->ntabs? x : 0] = false;          break;
+        case 3: memset(n->tabs, 0, sizeof(bool) * (n->ntabs)); break;
+    }
+ENDHANDLER
+
+HANDLER(cub) /* CUB - Cursor Backward */
+    s->xenl = false;
+    wmove(win, py, MAX(x - P1(0), 0));
+ENDHANDLER
+
+JUMPHANDLER(el) /* EL - Erase in Line */
+    cchar_t b;
+    setcchar(&b, L" ", A_NORMAL, colorpair(s->fg, s->bg), NULL);
+    if (jump.n == n && !P0(0) && x >= jump.row.ncells)
+        jumperase(win, x); /* the row stays out of the pad */
+    else{
+        settle(n);
+        switch (P0(0)){
+            case 0: wclrtoeol(win);                                                 break;
+            case 1: for (int i = 0; i <= x; i++) mvwadd_wchnstr(win, py, i, &b, 1); break;
+            case 2: wmove(win, py, 0); wclrtoeol(win);                              break;
+        }
+        wmove(win, py, x);
+        DIRTY(y, y);
+    }
+ENDHANDLER
+
+HANDLER(ed) /* ED - Erase in Display */
+    int o = 1;
+    switch (P0(0)){
+        case 0: wclrtobot(win);                     break;
+        case 3: werase(win); histclear(n);          break;
+        case 2: wmove(win, tos, 0); wclrtobot(win); break;
+        case 1:
+            for (int i = tos; i < py; i++){
+                wmove(win, i, 0);
+                wclrtoeol(win);
+            }
+            wmove(win, py, x);
+            el(v, p, w, iw, 1, &o, NULL);
+            break;
+    }
+    wmove(win, py, px);
+    DIRTY(0, my);
+ENDHANDLER
+
+HANDLER(ech) /* ECH - Erase Character */
+    cchar_t c;
+    setcchar(&c, L" ", A_NORMAL, colorpair(s->fg, s->bg), NULL);
+    for (int i = 0; i < P1(0); i++)
+        mvwadd_wchnstr(win, py, x + i, &c, 1);
+    wmove(win, py, px);
+    DIRTY(y, y);
+ENDHANDLER
+
+HANDLER(dsr) /* DSR - Device Status Report */
+    char buf[100] = {0};
+    if (P0(0) == 6)
+        snprintf(buf, sizeof(buf) - 1, "\033[%d;%dR",
+                 (n->decom? y - top : y) + 1, x + 1);
+    else
+        snprintf(buf, sizeof(buf) - 1, "\033[0n");
+    SEND(n, buf);
+ENDHANDLER
+
+HANDLER(idl) /* IL or DL - Insert/Delete Line */
+    /* we don't use insdelln here because it inserts above and not below,
+     * and has a few other edge cases... */
+    int otop = 0, obot = 0, p1 = MIN(P1(0), (my - 1) - y);
+    wgetscrreg(win, &otop, &obot);
+    wsetscrreg(win, py, obot);
+    wscrl(win, w == L'L'? -p1 : p1);
+    wsetscrreg(win, otop, obot);
+    wmove(win, py, 0);
+    DIRTY(y, my);
+ENDHANDLER
+
+HANDLER(csr) /* CSR - Change Scrolling Region */
+    if (wsetscrreg(win, tos + P1(0) - 1, tos + MIN(PD(1, my), my) - 1) == OK)
+        CALL(cup);
+ENDHANDLER
+
+HANDLER(decreqtparm) /* DECREQTPARM - Request Device Parameters */
+    SEND(n, P0(0)? "\033[3;1;2;120;1;0x" : "\033[2;1;2;120;128;1;0x");
+ENDHANDLER
+
+JUMPHANDLER(sgr0) /* Reset SGR to default */
+    wattrset(win, A_NORMAL);
+    wcolor_set(win, 0, NULL);
+    s->fg = s->bg = -1;
+    wbkgdset(win, COLOR_PAIR(0) | ' ');
+ENDHANDLER
+
+HANDLER(cls) /* Clear screen */
+    CALL(cup);
+    wclrtobot(win);
+    CALL(cup);
+    DIRTY(0, my);
+ENDHANDLER
+
+HANDLER(ris) /* RIS - Reset to Initial State */
+    n->gs = n->gc = n->g0 = CSET_US; n->g1 = CSET_GRAPH;
+    n->g2 = CSET_US; n->g3 = CSET_GRAPH;
+    n->decom = s->insert = s->oxenl = s->xenl = n->lnm = n->paste = false;
+    n->sync = false;
+    CALL(cls);
+    CALL(sgr0);
+    n->am = n->pnm = true;
+    n->pri.vis = n->alt.vis = 1;
+    n->s = &n->pri;
+    wsetscrreg(n->pri.win, n->pri.tos, n->pri.tos + n->h - 1);
+    wsetscrreg(n->alt.win, 0, n->h - 1);
+    for (int i = 0; i < n->ntabs; i++)
+        n->tabs[i] = (i % 8 == 0);
+ENDHANDLER
+
+HANDLER(mode) /* Set or Reset Mode */
+    bool set = (w == L'h'), dec = iw == L'?'; /* private: CSI ? Ps h */
+    for (int i = 0; i < argc; i++) switch (P0(i)){
+        case  1: n->pnm = set;              break;
+        case  3: CALL(cls);                 break;
+        case  4: s->insert = set;           break;
+        case  6: n->decom = set; CALL(cup); break;
+        case  7: n->am = set;               break;
+        case 20: n->lnm = set;              break;
+        case 25: s->vis = set? 1 : 0;       break;
+        case 34: s->vis = set? 1 : 2;       break;
+        case 2004: if (dec)
+                       n->paste = set;
+                   break;
+        case 2026: if (dec){                /* hold drawing until reset */
+                       n->sync = set;
+                       n->synced = now();
+                   }
+                   break;
+        case 1048: CALL((set? sc : rc));    break;
+        case 1049:
+            CALL((set? sc : rc)); /* fall-through */
+        case 47: case 1047: if (set && n->s != &n->alt){
+                n->s = &n->alt;
+                CALL(cls);
+            } else if (!set && n->s != &n->pri){
+                n->s = &n->pri;
+                DIRTY(0, n->h - 1);
+            }
+            break;
+    }
+ENDHANDLER
+
+HANDLER(decrqm) /* DECRQM - Request Mode */
+    int m = P0(0), st = 0; /* 0 is not recognized, 1 set, 2 reset */
+    if (iw == L'?') switch (m){ /* CSI ? Ps $ p; only the ? is collected */
+        case    1: st = n->pnm? 1 : 2;                 break;
+        case    6: st = n->decom? 1 : 2;               break;
+        case    7: st = n->am? 1 : 2;                  break;
+        case   25: st = s->vis == 1? 1 : 2;            break;
+        case 2004: st = n->paste? 1 : 2;               break;
+        case 2026: st = n->sync? 1 : 2;                break;
+        case 47: case 1047: case 1049:
+                   st = n->s == &n->alt? 1 : 2;        break;
+    } else if (iw == L'$') switch (m){ /* CSI Ps $ p */
+        case    4: st = s->insert? 1 : 2;              break;
+        case   20: st = n->lnm? 1 : 2;                 break;
+    }
+
+    char buf[32] = {0};
+    snprintf(buf, sizeof(buf) - 1, "\033[%s%d;%d$y", iw == L'?'? "?" : "", m, st);
+    if (iw == L'?' || iw == L'$') /* other CSI p sequences go unanswered */
+        SEND(n, buf);
+ENDHANDLER
+
+static int
+extcolor(VTPARSER *v, int argc, int *argv, int *i, int c) /* 38/48 colors */
+{
+    int k = 0, m = P0(*i + 1), r = *i + 2; /* the mode; where the color is */
+    bool sub = SUB(*i + 1);
+    while (SUB(*i + 1 + k))
+        k++;
+    if (m == 2 && sub && k >= 5) /* 38:2:colorspace:r:g:b */
+        r++;
+    *i += sub? k : m == 2? 4 : m == 5? 2 : 1;
+
+    #define LIMIT(x) MIN(MAX(P0(x), 0), 255)
+    int nc = m == 5? indexcolor(LIMIT(r))
+           : m == 2? rgbcolor(LIMIT(r), LIMIT(r + 1), LIMIT(r + 2)) : -2;
+    return nc < -1? c : nc;
+}
+
+JUMPHANDLER(sgr) /* SGR - Select Graphic Rendition */
+    bool doc = false, do8 = hostcolors >= 8, do16 = hostcolors >= 16;
+    if (!argc)
+        CALL(sgr0);
+
+    int bg = s->bg, fg = s->fg;
+    for (int i = 0; i < argc; i++) switch (SUB(i)? -1 : P0(i)){
+        case  0:  CALL(sgr0);                                              break;
+        case  1:  wattron(win,  A_BOLD);                                   break;
+        case  2:  wattron(win,  A_DIM);                                    break;
+        case  4:  if (SUB(i+1) && !P0(i+1)) /* 4:0 is no underline */
+                      wattroff(win, A_UNDERLINE);
+                  else
+                      wattron(win,  A_UNDERLINE);
+                  break;
+        case  5:  wattron(win,  A_BLINK);                                  break;
+        case  7:  wattron(win,  A_REVERSE);                                break;
+        case  8:  wattron(win,  A_INVIS);                                  break;
+        case 22:  wattroff(win, A_DIM); wattroff(win, A_BOLD);             break;
+        case 24:  wattroff(win, A_UNDERLINE);                              break;
+        case 25:  wattroff(win, A_BLINK);                                  break;
+        case 27:  wattroff(win, A_REVERSE);                                break;
+        case 30:  fg = COLOR_BLACK;                           doc = do8;   break;
+        case 31:  fg = COLOR_RED;                             doc = do8;   break;
+        case 32:  fg = COLOR_GREEN;                           doc = do8;   break;
+        case 33:  fg = COLOR_YELLOW;                          doc = do8;   break;
+        case 34:  fg = COLOR_BLUE;                            doc = do8;   break;
+        case 35:  fg = COLOR_MAGENTA;                         doc = do8;   break;
+        case 36:  fg = COLOR_CYAN;                            doc = do8;   break;
+        case 37:  fg = COLOR_WHITE;                           doc = do8;   break;
+        case 38:  fg = extcolor(v, argc, argv, &i, fg);       doc = true;  break;
+        case 39:  fg = -1;                                    doc = true;  break;
+        case 40:  bg = COLOR_BLACK;                           doc = do8;   break;
+        case 41:  bg = COLOR_RED;                             doc = do8;   break;
+        case 42:  bg = COLOR_GREEN;                           doc = do8;   break;
+        case 43:  bg = COLOR_YELLOW;                          doc = do8;   break;
+        case 44:  bg = COLOR_BLUE;                            doc = do8;   break;
+        case 45:  bg = COLOR_MAGENTA;                         doc = do8;   break;
+        case 46:  bg = COLOR_CYAN;                            doc = do8;   break;
+        case 47:  bg = COLOR_WHITE;                           doc = do8;   break;
+        case 48:  bg = extcolor(v, argc, argv, &i, bg);       doc = true;  break;
+        case 49:  bg = -1;                                    doc = true;  break;
+        case 90:  fg = COLOR_BLACK;                           doc = do16;  break;
+        case 91:  fg = COLOR_RED;                             doc = do16;  break;
+        case 92:  fg = COLOR_GREEN;                           doc = do16;  break;
+        case 93:  fg = COLOR_YELLOW;                          doc = do16;  break;
+        case 94:  fg = COLOR_BLUE;                            doc = do16;  break;
+        case 95:  fg = COLOR_MAGENTA;                         doc = do16;  break;
+        case 96:  fg = COLOR_CYAN;                            doc = do16;  break;
+        case 97:  fg = COLOR_WHITE;                           doc = do16;  break;
+        case 100: bg = COLOR_BLACK;                           doc = do16;  break;
+        case 101: bg = COLOR_RED;                             doc = do16;  break;
+        case 102: bg = COLOR_GREEN;                           doc = do16;  break;
+        case 103: bg = COLOR_YELLOW;                          doc = do16;  break;
+        case 104: bg = COLOR_BLUE;                            doc = do16;  break;
+        case 105: bg = COLOR_MAGENTA;                         doc = do16;  break;
+        case 106: bg = COLOR_CYAN;                            doc = do16;  break;
+        case 107: bg = COLOR_WHITE;                           doc = do16;  break;
+        #if defined(A_ITALIC) && !defined(NO_ITALICS )
+        case  3:  wattron(win,  A_ITALIC);                    break;
+        case 23:  wattroff(win, A_ITALIC);                    break;
+        #endif
+    }
+    if (doc){
+        int p = colorpair(s->fg = fg, s->bg = bg);
+        wcolor_set(win, p, NULL);
+        cchar_t c;
+        setcchar(&c, L" ", A_NORMAL, p, NULL);
+        wbkgrndset(win, &c);
+   }
+}
+
+JUMPHANDLER(cr) /* CR - Carriage Return */
+    s->xenl = false;
+    wmove(win, py, 0);
+ENDHANDLER
+
+JUMPHANDLER(ind) /* IND - Index */
+    if (jump.n == n)
+        jumpline(n); /* the row goes by without reaching the pad */
+    else if (y == bot - 1 && s == &n->pri && !top && bot == my)
+        advance(n); /* the whole screen scrolls into the scrollback */
+    else
+        y == (bot - 1)? scroll(win) : wmove(win, MIN(py + 1, tos + my - 1), x);
+    if (y == bot - 1)
+        DIRTY(top, bot - 1);
+ENDHANDLER
+
+JUMPHANDLER(nel) /* NEL - Next Line */
+    CALL(cr); CALL(ind);
+ENDHANDLER
+
+JUMPHANDLER(pnl) /* NL - Newline */
+    CALL((n->lnm? nel : ind));
+ENDHANDLER
+
+HANDLER(cpl) /* CPL - Cursor Previous Line */
+    wmove(win, MAX(tos + top, py - P1(0)), 0);
+ENDHANDLER
+
+HANDLER(cnl) /* CNL - Cursor Next Line */
+    wmove(win, MIN(tos + bot - 1, py + P1(0)), 0);
+ENDHANDLER
+
+HANDLER(print) /* Print a character to the terminal */
+    if (wcwidth(w) < 0)
+        return;
 
-    /* restore colors */
-    int cp = alloc_pair(s->fg, s->bg);
-    wcolor_set(win, cp, NULL);
-    cchar_t c;
-    setcchar(&c, L" ", A_NORMAL, cp, NULL);
-    wbkgrndset(win, &c);
+    if (s->insert)
+        CALL(ich);
+
+    if (s->xenl){
+        s->xenl = false;
+        if (n->am)
+            CALL(nel);
+        getyx(win, y, x);
+        y -= s->tos;
+    }
+
+    if (w < MAXMAP && n->gc[w])
+        w = n->gc[w];
+    n->repc = w;
+
+    if (x == mx - wcwidth(w)){
+        s->xenl = true;
+        wins_nwstr(win, &w, 1);
+    } else
+        waddnwstr(win, &w, 1);
+    n->gc = n->gs;
+    DIRTY(y, y);
+} /* no ENDHANDLER because we don't want to reset repc */
+
+JUMPHANDLER(printn) /* Print a run of characters to the terminal */
+    for (int i = 0; i < argc; ){
+        if (s->xenl && n->am && !s->insert && jump.n == n && wcwidth(osc[i]) >= 0){
+            s->xenl = false; /* wrap as print would, keeping the row out */
+            CALL(nel);
+            getyx(win, py, x);
+        }
+
+        /* Narrow, unmapped characters short of the last column can go to the
+         * pad as one segment, and to a kept-out row up to and including it;
+         * everything else is handled by print. */
+        int k = 0;
+        if (!s->insert && !s->xenl && n->gc == CSET_US && n->gs == CSET_US)
+            while (x + k < mx && i + k < argc && (osc[i + k] < 0x7f || wcwidth(osc[i + k]) == 1))
+                k++;
+        bool last = k && x + k == mx;
+
+        if (k && jump.n == n && x < jump.row.ncells)
+            settle(n); /* it went back over the row */
+        if (k && (jump.n == n || (n->jumping && s == &n->pri && !top
+                                  && bot == my && y == bot - 1 && startjump(n)))){
+            jumptext(win, x, osc + i, k);
+            wmove(win, py, x + k - last);
+            s->xenl = last;
+        } else if ((k -= last)){
+            waddnwstr(win, osc + i, k);
+            DIRTY(py - s->tos, py - s->tos);
+        } else{
+            print(v, p, osc[i++], 0, 0, NULL, NULL);
+            getyx(win, py, x);
+            continue;
+        }
+        n->repc = osc[i + k - 1];
+        x = getcurx(win);
+        i += k;
+    }
+} /* no ENDHANDLER because we don't want to reset repc */
+
+HANDLER(rep) /* REP - Repeat Character */
+    for (int i = 0; i < P1(0) && n->repc; i++)
+        print(v, p, n->repc, 0, 0, NULL, NULL);
+ENDHANDLER
+
+HANDLER(scs) /* Select Character Set */
+    wchar_t **t = NULL;
+    switch (iw){
+        case L'(': t = &n->g0;  break;
+        case L')': t = &n->g1;  break;
+        case L'*': t = &n->g2;  break;
+        case L'+': t = &n->g3;  break;
+        default: return;        break;
+    }
+    switch (w){
+        case L'A': *t = CSET_UK;    break;
+        case L'B': *t = CSET_US;    break;
+        case L'0': *t = CSET_GRAPH; break;
+        case L'1': *t = CSET_US;    break;
+        case L'2': *t = CSET_GRAPH; break;
+    }
+ENDHANDLER
+
+HANDLER(so) /* Switch Out/In Character Set */
+    if (w == 0x0e)
+        n->gs = n->gc = n->g1; /* locking shift */
+    else if (w == 0xf)
+        n->gs = n->gc = n->g0; /* locking shift */
+    else if (w == L'n')
+        n->gs = n->gc = n->g2; /* locking shift */
+    else if (w == L'o')
+        n->gs = n->gc = n->g3; /* locking shift */
+    else if (w == L'N'){
+        n->gs = n->gc; /* non-locking shift */
+        n->gc = n->g2;
+    } else if (w == L'O'){
+        n->gs = n->gc; /* non-locking shift */
+        n->gc = n->g3;
+    }
+ENDHANDLER
+
+/*** STRINGS
+ * The parser passes on OSC strings a piece at a time, however long they
+ * are. A view collects the pieces, up to OSC_LIMIT bytes of them, and acts
+ * on the string once it's terminated: OSC 0 and 2 (and screen's ESC k)
+ * set the view's title, which the bottom row shows while it's focused,
+ * and OSC 52 sets the clipboard, which is passed on to the host terminal.
+ * DCS, APC, PM and SOS strings are ignored.
+ */
+#define BASE64 "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/="
+
+static struct{
+    char *b;
+    size_t len, cap;
+} tohost; /* OSCs for the host terminal */
+
+static void
+appendosc(NODE *n, const wchar_t *s, int len) /* Collect part of a string. */
+{
+    size_t need = n->osclen + (size_t)len * MB_CUR_MAX + 1;
+    if (n->oscover || (n->oscover = need > OSC_LIMIT))
+        return;
+    if (need > n->osccap){ /* doubling, so long strings are copied O(n) times */
+        size_t cap = MAX(need, n->osccap * 2);
+        char *b = realloc(n->osc, cap);
+        if (!b){
+            n->oscover = true;
+            return;
+        }
+        n->osc = b;
+        n->osccap = cap;
+    }
+
+    mbstate_t ms;
+    memset(&ms, 0, sizeof(ms));
+    for (int i = 0; i < len; i++){
+        size_t k = s[i] < 0x80? 1 : wcrtomb(n->osc + n->osclen, s[i], &ms);
+        if (s[i] < 0x80)
+            n->osc[n->osclen] = (char)s[i];
+        n->osclen += k == (size_t)-1? 0 : k;
+    }
+    n->osc[n->osclen] = 0;
+}
+
+static void
+settitle(NODE *n, const char *t) /* Set n's title. */
+{
+    wchar_t w[TITLE_SIZE];
+    size_t k = mbstowcs(w, t, TITLE_SIZE - 1);
+    wchar_t *c = k == (size_t)-1? NULL : calloc(k + 1, sizeof(wchar_t));
+    if (!c)
+        return;
+    for (size_t i = 0; i < k; i++)
+        c[i] = iswprint(w[i])? w[i] : L'?';
+    free(n->title);
+    n->title = c;
+}
+
+static void
+hostosc(const char *s, size_t len) /* Queue an OSC for the host terminal. */
+{
+    size_t need = tohost.len + len + 3;
+    if (need > tohost.cap){
+        char *b = realloc(tohost.b, MAX(need, tohost.cap * 2));
+        if (!b)
+            return;
+        tohost.b = b;
+        tohost.cap = MAX(need, tohost.cap * 2);
+    }
+    memcpy(tohost.b + tohost.len, "\033]", 2);
+    memcpy(tohost.b + tohost.len + 2, s, len);
+    tohost.b[tohost.len + len + 2] = '\a';
+    tohost.len = need;
+}
+
+static void
+doosc(NODE *n, bool screen) /* Act on a terminated OSC string. */
+{
+    char *t = n->osc, *e = t;
+    long k = screen? 2 : strtol(t, &e, 10);
+    if (!screen && (e == t || *e != ';'))
+        return;
+    t = screen? t : e + 1;
+
+    if (k == 0 || k == 2)
+        settitle(n, t);
+    else if (k == 52 && CLIPBOARD){ /* only setting it; the host may refuse */
+        const char *d = t + strspn(t, "cpqs01234567");
+        if (*d == ';' && strspn(d + 1, BASE64) == strlen(d + 1))
+            hostosc(n->osc, n->osclen);
+    }
+}
+
+HANDLER(osc) /* OSC - Operating System Command, and other strings */
+    bool want = w == L']' || w == L'k'; /* screen titles are ESC k ... ST */
+    switch (iw){
+        case VTPARSER_STRING_START:
+            n->osclen = 0;
+            n->oscover = false;
+            break;
+
+        case VTPARSER_STRING_DATA:
+            if (want)
+                appendosc(n, osc, argc);
+            break;
+
+        case VTPARSER_STRING_END:
+            if (want && argc && !n->oscover && n->osc)
+                doosc(n, w == L'k');
+            if (n->osccap > READ_SIZE){ /* don't hang on to big ones */
+                free(n->osc);
+                n->osc = NULL;
+                n->osccap = 0;
+            }
+            n->osclen = 0;
+            break;
+    }
 ENDHANDLER
 
-HANDLER(tbc) /* TBC - Tabulation Clear */
-    switch (P0(0)){
-        case 0: n->tabs[x < n->ntabs? x : 0] = false;          break;
-        case 3: memset(n->tabs, 0, sizeof(bool) * (n->ntabs)); break;
+static void
+setupevents(void)
+{
+    vtonevent(&callbacks, VTPARSER_CONTROL, 0x05, ack);
+    vtonevent(&callbacks, VTPARSER_CONTROL, 0x07, bell);
+    vtonevent(&callbacks, VTPARSER_CONTROL, 0x08, cub);
+    vtonevent(&callbacks, VTPARSER_CONTROL, 0x09, tab);
+    vtonevent(&callbacks, VTPARSER_CONTROL, 0x0a, pnl);
+    vtonevent(&callbacks, VTPARSER_CONTROL, 0x0b, pnl);
+    vtonevent(&callbacks, VTPARSER_CONTROL, 0x0c, pnl);
+    vtonevent(&callbacks, VTPARSER_CONTROL, 0x0d, cr);
+    vtonevent(&callbacks, VTPARSER_CONTROL, 0x0e, so);
+    vtonevent(&callbacks, VTPARSER_CONTROL, 0x0f, so);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'A', cuu);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'B', cud);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'C', cuf);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'D', cub);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'E', cnl);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'F', cpl);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'G', hpa);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'H', cup);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'I', tab);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'J', ed);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'K', el);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'L', idl);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'M', idl);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'P', dch);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'S', su);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'T', su);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'X', ech);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'Z', tab);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'`', hpa);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'^', su);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'@', ich);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'a', hpr);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'b', rep);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'c', decid);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'd', vpa);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'e', vpr);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'f', cup);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'g', tbc);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'h', mode);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'l', mode);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'm', sgr);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'n', dsr);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'p', decrqm);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'r', csr);
+    vtonevent(&callbacks, VTPARSER_CSI,     L's', sc);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'u', rc);
+    vtonevent(&callbacks, VTPARSER_CSI,     L'x', decreqtparm);
+    vtonevent(&callbacks, VTPARSER_ESCAPE,  L'0', scs);
+    vtonevent(&callbacks, VTPARSER_ESCAPE,  L'1', scs);
+    vtonevent(&callbacks, VTPARSER_ESCAPE,  L'2', scs);
+    vtonevent(&callbacks, VTPARSER_ESCAPE,  L'7', sc);
+    vtonevent(&callbacks, VTPARSER_ESCAPE,  L'8', rc);
+    vtonevent(&callbacks, VTPARSER_ESCAPE,  L'A', scs);
+    vtonevent(&callbacks, VTPARSER_ESCAPE,  L'B', scs);
+    vtonevent(&callbacks, VTPARSER_ESCAPE,  L'D', ind);
+    vtonevent(&callbacks, VTPARSER_ESCAPE,  L'E', nel);
+    vtonevent(&callbacks, VTPARSER_ESCAPE,  L'H', hts);
+    vtonevent(&callbacks, VTPARSER_ESCAPE,  L'M', ri);
+    vtonevent(&callbacks, VTPARSER_ESCAPE,  L'Z', decid);
+    vtonevent(&callbacks, VTPARSER_ESCAPE,  L'c', ris);
+    vtonevent(&callbacks, VTPARSER_ESCAPE,  L'p', vis);
+    vtonevent(&callbacks, VTPARSER_ESCAPE,  L'=', numkp);
+    vtonevent(&callbacks, VTPARSER_ESCAPE,  L'>', numkp);
+    vtonevent(&callbacks, VTPARSER_PRINT,   0,    print);
+    vtonevent(&callbacks, VTPARSER_PRINTN,  0,    printn);
+    vtonevent(&callbacks, VTPARSER_OSC,     0,    osc);
+}
+
+/*** EVENT LOOP
+ * Every view's pty, and the keyboard, is registered with epoll(7) where
+ * available and poll(2) elsewhere, along with a pointer to its view (NULL
+ * for the keyboard). Waiting fills in the ready array with the views that
+ * have input, so a wakeup only touches those.
+ *
+ * Writes to a pty are queued, up to QUEUE_SIZE bytes per view, and written
+ * out together once per pass through the main loop, so that a paste or a
+ * burst of typing costs one write rather than one per key. Whatever the
+ * pty won't take yet stays queued, and the pty is watched for writability
+ * until the queue is empty again. While the focused view's queue is over
+ * half full, the keyboard isn't read, so the host terminal's own flow
+ * control holds back typing and pasting until the program catches up.
+ */
+static bool
+initpoll(void)
+{
+    #ifdef __linux__
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    return epfd >= 0;
+    #else
+    return true;
+    #endif
+}
+
+static bool
+watch(NODE *n, int fd) /* Start waiting for input on fd, for view n. */
+{
+    #ifdef __linux__
+    struct epoll_event e = {.events = EPOLLIN, .data.ptr = n};
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e) == 0;
+    #else
+    if (npfds == maxpfds){
+        int m = maxpfds * 2 + 8;
+        struct pollfd *f = realloc(pfds, m * sizeof(struct pollfd));
+        NODE **v = f? realloc(pnodes, m * sizeof(NODE *)) : NULL;
+        pfds = f? f : pfds;
+        pnodes = v? v : pnodes;
+        if (!f || !v)
+            return false;
+        maxpfds = m;
+    }
+    pfds[npfds] = (struct pollfd){.fd = fd, .events = POLLIN};
+    pnodes[npfds] = n;
+    if (n)
+        n->slot = npfds;
+    else if (fd == keyfd)
+        keyslot = npfds;
+    npfds++;
+    return true;
+    #endif
+}
+
+static void
+setwatch(NODE *n) /* Wait for input unless n's throttled, output if queued. */
+{
+    #ifdef __linux__
+    struct epoll_event e = {.data.ptr = n};
+    e.events = (n->resume? 0 : EPOLLIN) | (n->armed? EPOLLOUT : 0);
+    epoll_ctl(epfd, EPOLL_CTL_MOD, n->pt, &e);
+    #else
+    if (n->slot >= 0)
+        pfds[n->slot].events = (n->resume? 0 : POLLIN) | (n->armed? POLLOUT : 0);
+    #endif
+}
+
+static void
+watchkeys(bool on) /* Turn input notification for the keyboard on or off. */
+{
+    static bool watching = true;
+    if (on == watching || headless)
+        return;
+    watching = on;
+    #ifdef __linux__
+    struct epoll_event e = {.events = on? EPOLLIN : 0, .data.ptr = NULL};
+    epoll_ctl(epfd, EPOLL_CTL_MOD, keyfd, &e);
+    #else
+    pfds[keyslot].events = on? POLLIN : 0;
+    #endif
+}
+
+static void
+flushout(NODE *n) /* Write as much of n's queue as its pty will take. */
+{
+    while (n->outlen){
+        size_t c = MIN(n->outlen, n->outcap - n->outhead);
+        ssize_t w = write(n->pt, n->out + n->outhead, c);
+        if (w < 0 && errno == EINTR)
+            continue;
+        else if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else if (w <= 0) /* the pty's gone; reading from it will say so */
+            n->outlen = 0;
+        else{
+            n->outhead = (n->outhead + (size_t)w) % n->outcap;
+            n->outlen -= (size_t)w;
+            n->drained = now();
+        }
+    }
+    if (!n->outlen && n->outcap > MINQUEUE){ /* give back what a paste took */
+        free(n->out);
+        n->out = NULL;
+        n->outcap = 0;
+    }
+    if (!n->outlen)
+        n->outhead = 0;
+    if (n->armed != (n->outlen > 0)){
+        n->armed = n->outlen > 0;
+        setwatch(n);
+    }
+}
+
+static void
+flushall(void) /* Write out what's been queued since the last time. */
+{
+    while (unsent){
+        NODE *n = unsent;
+        unsent = n->nextunsent;
+        n->unsent = false;
+        flushout(n);
+    }
+}
+
+static bool
+reserve(NODE *n, size_t c) /* Make room for c more bytes in n's queue. */
+{
+    size_t cap = n->outcap? n->outcap : MINQUEUE;
+    if (c > QUEUE_SIZE - n->outlen)
+        return false;
+    if (n->outlen + c <= n->outcap)
+        return true;
+    while (cap < n->outlen + c)
+        cap *= 2;
+    cap = MIN(cap, QUEUE_SIZE);
+
+    char *b = malloc(cap);
+    if (!b)
+        return false;
+    size_t k = MIN(n->outlen, n->outcap - n->outhead); /* unwrap the ring */
+    if (n->outlen){
+        memcpy(b, n->out + n->outhead, k);
+        memcpy(b + k, n->out, n->outlen - k);
+    }
+    free(n->out);
+    n->out = b;
+    n->outcap = cap;
+    n->outhead = 0;
+    return true;
+}
+
+static void
+queue(NODE *n, const char *b, size_t c) /* Queue c bytes of b for n's pty. */
+{
+    if (n->pt < 0 || !c || !reserve(n, c)) /* what doesn't fit is dropped */
+        return;
+
+    size_t t = (n->outhead + n->outlen) % n->outcap, k = MIN(c, n->outcap - t);
+    memcpy(n->out + t, b, k);
+    memcpy(n->out, b + k, c - k);
+    if (!n->outlen)
+        n->drained = now();
+    n->outlen += c;
+    if (!n->unsent && !n->armed){ /* armed views are flushed when writable */
+        n->unsent = true;
+        n->nextunsent = unsent;
+        unsent = n;
+    }
+}
+
+static bool
+backedup(const NODE *n) /* Should typing wait for n to read what it has? */
+{
+    return n->outlen > QUEUE_SIZE / 2 && now() < n->drained + STALL_MS / 1000.0;
+}
+
+static void
+throttle(NODE *n) /* Leave n unread for a while. */
+{
+    if (n->resume)
+        return;
+    n->resume = now() + THROTTLE_MS / 1000.0;
+    n->nextpaused = paused;
+    paused = n;
+    setwatch(n);
+}
+
+static int
+resume(double t) /* Resume views throttled until t; ms to the next one. */
+{
+    int ms = -1;
+    for (NODE **p = &paused; *p; ) if ((*p)->resume <= t){
+        (*p)->resume = 0.0;
+        setwatch(*p);
+        *p = (*p)->nextpaused;
+    } else{
+        int d = (int)(((*p)->resume - t) * 1000.0) + 1;
+        ms = ms < 0? d : MIN(ms, d);
+        p = &(*p)->nextpaused;
+    }
+    return ms;
+}
+
+static void
+unpause(NODE *n) /* Stop leaving n unread. */
+{
+    for (NODE **p = &paused; *p; p = &(*p)->nextpaused) if (*p == n){
+        *p = n->nextpaused;
+        break;
+    }
+    n->resume = 0.0;
+}
+
+static void
+unwatch(NODE *n) /* Stop waiting for input for n. */
+{
+    for (int i = 0; i < nready; i++) if (ready[i] == n)
+        ready[i] = NULL;
+    unpause(n);
+    for (NODE **p = &unsent; *p; p = &(*p)->nextunsent) if (*p == n){
+        *p = n->nextunsent;
+        break;
+    }
+
+    #ifdef __linux__
+    epoll_ctl(epfd, EPOLL_CTL_DEL, n->pt, NULL);
+    #else
+    if (n->slot < 0)
+        return;
+    pfds[n->slot] = pfds[--npfds];
+    pnodes[n->slot] = pnodes[npfds];
+    if (pnodes[n->slot])
+        pnodes[n->slot]->slot = n->slot;
+    else if (keyslot == npfds)
+        keyslot = n->slot;
+    else if (clientslot == npfds)
+        clientslot = n->slot;
+    n->slot = -1;
+    #endif
+}
+
+static void
+noteready(NODE *n, bool in, bool out, bool hup) /* Note what n's pty is ready for. */
+{
+    if (out)
+        flushout(n);
+    if (hup && n->resume){ /* read what's left now, and find it's gone */
+        unpause(n);
+        setwatch(n);
+    }
+    if ((in || hup) && !n->resume)
+        ready[nready++] = n;
+}
+
+static void
+waitready(int timeout) /* Wait for input, filling in the ready views. */
+{
+    nready = 0;
+    #ifdef __linux__
+    struct epoll_event e[MAXREADY];
+    int r = epoll_wait(epfd, e, MAXREADY, timeout);
+    for (int i = 0; i < r; i++) if (e[i].data.ptr)
+        noteready(e[i].data.ptr, e[i].events & EPOLLIN, e[i].events & EPOLLOUT,
+               e[i].events & (EPOLLHUP | EPOLLERR));
+    #else
+    if (poll(pfds, npfds, timeout) > 0)
+        for (int i = 0; i < npfds && nready < MAXREADY; i++) if (pnodes[i])
+            noteready(pnodes[i], pfds[i].revents & POLLIN, pfds[i].revents & POLLOUT,
+                   pfds[i].revents & (POLLHUP | POLLERR | POLLNVAL));
+    #endif
+}
+
+/*** RECORDING
+ * With -L, mtm logs everything that changes its views' screens: each
+ * view's output as it's read, the keys it handles, and changes in the
+ * size of the screen, each with the time since recording started.
+ * Views are identified by the order in which they were opened. When mtm
+ * exits, a hash of the final contents of every view's screen is logged.
+ *
+ * The log starts with a HEADER, and each record is a RECORD followed by
+ * len bytes of output, all in the host's byte order. Replaying it (with
+ * -B or -P) feeds the same records through the same paths, with no
+ * programs running in the views, and checks the hash at the end.
+ */
+#define RECORD_MAGIC "mtmrec1"
+
+typedef enum{
+    REC_OUTPUT, /* len bytes of output for view */
+    REC_KEY,    /* a is what wget_wch returned and b the key */
+    REC_SIZE,   /* the screen is now a rows by b columns */
+    REC_CLOSE,  /* view's program has exited */
+    REC_SCREEN  /* the screens hash to a << 32 | b */
+} Rec;
+
+typedef struct HEADER HEADER;
+struct HEADER{
+    char magic[8];
+    int32_t rows, cols, commandkey;
+    char term[64];  /* the host terminal's type */
+};
+
+typedef struct RECORD RECORD;
+struct RECORD{
+    uint64_t ns;    /* since recording started */
+    int32_t t, view, a, b;
+    uint32_t len;
+};
+
+static struct{
+    FILE *f;
+    double start;
+} rec;
+static int nextid = 0;
+
+static void
+record(Rec t, const NODE *n, int a, int b, const char *data, uint32_t len) /* Log. */
+{
+    if (!rec.f)
+        return;
+    RECORD r = {(uint64_t)((now() - rec.start) * 1e9), t, n? n->id : -1, a, b, len};
+    fwrite(&r, sizeof(r), 1, rec.f);
+    if (len)
+        fwrite(data, 1, len, rec.f);
+}
+
+static uint64_t
+hash(uint64_t h, const void *p, size_t n) /* Add n bytes at p to FNV-1a hash h. */
+{
+    for (const unsigned char *c = p; n--; c++)
+        h = (h ^ *c) * 1099511628211ULL;
+    return h;
+}
+
+static uint64_t
+hashview(uint64_t h, NODE *n) /* Add what's on the screens under n to h. */
+{
+    if (n->t != VIEW)
+        return hashview(hashview(h, n->c1), n->c2);
+
+    int y, x, k[4] = {n->id, n->s == &n->alt, 0, 0};
+    cchar_t *c = cells(n->w + 1);
+    getyx(n->s->win, y, x);
+    k[2] = y - n->s->tos;
+    k[3] = x;
+    h = hash(h, k, sizeof(k));
+    for (int i = 0; c && i < n->h; i++){
+        mvwin_wchnstr(n->s->win, n->s->tos + i, 0, c, n->w);
+        for (int j = 0; j < n->w; j++){ /* pair numbers vary; their colors don't */
+            wchar_t b[CCHARW_MAX + 1];
+            attr_t a;
+            int p, e[4] = {(int)cellparts(&c[j], b, &a, &p)[0], (int)a,
+                           p? pairs[p].fg : -1, p? pairs[p].bg : -1};
+            h = hash(h, e, sizeof(e));
+        }
     }
-ENDHANDLER
+    wmove(n->s->win, y, x);
+    return h;
+}
 
-HANDLER(cub) /* CUB - Cursor Backward */
-    s->xenl = false;
-    wmove(win, py, MAX(x - P1(0), 0));
-ENDHANDLER
+static uint64_t
+screenhash(void) /* Hash the screens of every view in every window. */
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (int i = 0; i < nwins; i++)
+        h = hashview(h, i == curwin? root : wins[i].root);
+    return h;
+}
 
-HANDLER(el) /* EL - Erase in Line */
-    cchar_t b;
-    setcchar(&b, L" ", A_NORMAL, alloc_pair(s->fg, s->bg), NULL);
-    switch (P0(0)){
-        case 0: wclrtoeol(win);                                                 break;
-        case 1: for (int i = 0; i <= x; i++) mvwadd_wchnstr(win, py, i, &b, 1); break;
-        case 2: wmove(win, py, 0); wclrtoeol(win);                              break;
+static bool
+startrecording(const char *path) /* Start logging to path. */
+{
+    HEADER h = {RECORD_MAGIC, LINES, COLS, commandkey, ""};
+    snprintf(h.term, sizeof(h.term), "%s", getenv("TERM")? getenv("TERM") : "");
+    if (!(rec.f = fopen(path, "wb")) || fwrite(&h, sizeof(h), 1, rec.f) != 1)
+        return false;
+    fcntl(fileno(rec.f), F_SETFD, FD_CLOEXEC);
+    rec.start = now();
+    return true;
+}
+
+static void
+endrecording(void) /* Log the final screens and stop. */
+{
+    if (rec.f && root){
+        uint64_t h = screenhash();
+        record(REC_SCREEN, NULL, (int)(uint32_t)(h >> 32), (int)(uint32_t)h, NULL, 0);
     }
-    wmove(win, py, x);
-ENDHANDLER
+    if (rec.f)
+        fclose(rec.f);
+    rec.f = NULL;
+}
 
-HANDLER(ed) /* ED - Erase in Display */
-    int o = 1;
-    switch (P0(0)){
-        case 0: wclrtobot(win);                     break;
-        case 3: werase(win);                        break;
-        case 2: wmove(win, tos, 0); wclrtobot(win); break;
-        case 1:
-            for (int i = tos; i < py; i++){
-                wmove(win, i, 0);
-                wclrtoeol(win);
+/*** SESSIONS
+ * With -a, mtm runs as a server that owns the views and their ptys, and
+ * any number of clients attach to it, one at a time, over a Unix socket
+ * named for the session, in a directory that only its user can get into.
+ * While nobody's attached, output is still parsed but nothing is drawn.
+ * Attaching repaints the whole screen, and from then on curses sends only
+ * what changed, row by row. The client sends its terminal type, its window
+ * size and its keys as MSGs, and the keys are passed on to curses through
+ * a pty, so that it can read them as if they had been typed.
+ *
+ * curses can't retry a write that would block, so it writes to a pipe,
+ * and a thread of its own, the pump, passes what comes out of the pipe on
+ * to the client, queueing what the client won't take yet. The main loop
+ * never waits for a client: one that falls CLIENT_LIMIT bytes behind is
+ * cut off, and reading from it finds that it's gone. The pump switches
+ * from one client to the next only once it has taken everything written
+ * for the first, so that each gets its own output and no more.
+ */
+typedef enum{
+    MSG_KEYS,   /* len bytes of keys follow */
+    MSG_SIZE,   /* the client's terminal is rows by cols */
+    MSG_TERM    /* len bytes of the client's terminal type follow */
+} Msg;
+
+typedef struct MSG MSG;
+struct MSG{
+    Msg t;
+    int len, rows, cols;
+};
+
+static struct{
+    int listen, client, host, keys;  /* sockets, the screen, the key pty */
+    size_t len, left;   /* bytes buffered; bytes of keys left in a MSG */
+    char buf[READ_SIZE];
+    char term[64];      /* the terminal type curses is drawing for */
+    bool sized;         /* has the client said what its terminal is? */
+} session = {.listen = -1, .client = -1, .host = -1, .keys = -1};
+
+static volatile sig_atomic_t resized = 0;
+
+static struct{
+    pthread_mutex_t lock;
+    pthread_cond_t switched;
+    int out, wake[2];       /* the end of curses' pipe; wakes the pump */
+    int next;               /* the client to switch to */
+    bool switching;
+    int fd;                 /* the pump's own: the client it writes to, */
+    char *b;                /* and what that client hasn't taken yet */
+    size_t off, len, cap;
+} sink = {.lock = PTHREAD_MUTEX_INITIALIZER,
+          .switched = PTHREAD_COND_INITIALIZER,
+          .out = -1, .wake = {-1, -1}, .next = -1, .fd = -1};
+
+static void
+dropclient(void) /* Stop writing to a client that isn't keeping up. */
+{
+    shutdown(sink.fd, SHUT_RDWR); /* the main loop reads that it's gone */
+    sink.fd = -1;
+    sink.off = sink.len = 0;
+}
+
+static void
+drainsink(char *buf) /* Take what curses has written, for the client. */
+{
+    ssize_t r;
+    while ((r = read(sink.out, buf, READ_SIZE)) > 0){
+        if (sink.fd < 0)
+            continue; /* nobody's attached */
+        if (sink.off && sink.len + r > sink.cap){
+            memmove(sink.b, sink.b + sink.off, sink.len - sink.off);
+            sink.len -= sink.off;
+            sink.off = 0;
+        }
+        if (sink.len + r > CLIENT_LIMIT){
+            dropclient();
+            continue;
+        }
+        if (sink.len + r > sink.cap){
+            size_t c = MIN(MAX(sink.cap * 2, sink.len + r), CLIENT_LIMIT);
+            char *b = realloc(sink.b, c);
+            if (!b){
+                dropclient();
+                continue;
             }
-            wmove(win, py, x);
-            el(v, p, w, iw, 1, &o, NULL);
+            sink.b = b;
+            sink.cap = c;
+        }
+        memcpy(sink.b + sink.len, buf, r);
+        sink.len += r;
+    }
+}
+
+static void
+sendsink(void) /* Send the client as much as it'll take without waiting. */
+{
+    while (sink.fd >= 0 && sink.off < sink.len){
+        ssize_t w = send(sink.fd, sink.b + sink.off, sink.len - sink.off,
+                         MSG_DONTWAIT);
+        if (w > 0)
+            sink.off += (size_t)w;
+        else if (w < 0 && errno == EINTR)
+            continue;
+        else if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            dropclient();
+        else
             break;
     }
-    wmove(win, py, px);
-ENDHANDLER
+    if (sink.off == sink.len){
+        sink.off = sink.len = 0;
+        if (sink.cap > READ_SIZE){
+            free(sink.b);
+            sink.b = NULL;
+            sink.cap = 0;
+        }
+    }
+}
 
-HANDLER(ech) /* ECH - Erase Character */
-    cchar_t c;
-    setcchar(&c, L" ", A_NORMAL, alloc_pair(s->fg, s->bg), NULL);
-    for (int i = 0; i < P1(0); i++)
-        mvwadd_wchnstr(win, py, x + i, &c, 1);
-    wmove(win, py, px);
-ENDHANDLER
+static void *
+pump(void *arg) /* Pass what curses writes on to the client, forever. */
+{
+    char *buf = malloc(READ_SIZE);
+    sigset_t all;
+    (void)arg;
+    sigfillset(&all); /* signals are for the main thread */
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    if (!buf)
+        return NULL;
 
-HANDLER(dsr) /* DSR - Device Status Report */
-    char buf[100] = {0};
-    if (P0(0) == 6)
-        snprintf(buf, sizeof(buf) - 1, "\033[%d;%dR",
-                 (n->decom? y - top : y) + 1, x + 1);
-    else
-        snprintf(buf, sizeof(buf) - 1, "\033[0n");
-    SEND(n, buf);
-ENDHANDLER
+    while (true){
+        struct pollfd p[] = {{.fd = sink.out, .events = POLLIN},
+                             {.fd = sink.wake[0], .events = POLLIN},
+                             {.fd = sink.fd, .events = sink.len? POLLOUT : 0}};
+        poll(p, 3, -1);
+        drainsink(buf);
+        if (p[2].revents & (POLLHUP | POLLERR) && p[2].fd == sink.fd)
+            dropclient();
+        sendsink();
 
-HANDLER(idl) /* IL or DL - Insert/Delete Line */
-    /* we don't use insdelln here because it inserts above and not below,
-     * and has a few other edge cases... */
-    int otop = 0, obot = 0, p1 = MIN(P1(0), (my - 1) - y);
-    wgetscrreg(win, &otop, &obot);
-    wsetscrreg(win, py, obot);
-    wscrl(win, w == L'L'? -p1 : p1);
-    wsetscrreg(win, otop, obot);
-    wmove(win, py, 0);
-ENDHANDLER
+        pthread_mutex_lock(&sink.lock);
+        while (read(sink.wake[0], buf, READ_SIZE) > 0)
+            continue;
+        if (sink.switching){
+            drainsink(buf); /* what was written up to now is the old client's */
+            sendsink();
+            sink.fd = sink.next;
+            sink.off = sink.len = 0;
+            sink.switching = false;
+            pthread_cond_signal(&sink.switched);
+        }
+        pthread_mutex_unlock(&sink.lock);
+    }
+    return NULL; /* not reached */
+}
 
-HANDLER(csr) /* CSR - Change Scrolling Region */
-    if (wsetscrreg(win, tos + P1(0) - 1, tos + PD(1, my) - 1) == OK)
-        CALL(cup);
-ENDHANDLER
+static void
+switchclient(int fd) /* Have the pump write to fd, once it's done with the last. */
+{
+    pthread_mutex_lock(&sink.lock);
+    sink.next = fd;
+    sink.switching = true;
+    while (write(sink.wake[1], "", 1) < 0 && errno == EINTR)
+        continue;
+    while (sink.switching)
+        pthread_cond_wait(&sink.switched, &sink.lock);
+    pthread_mutex_unlock(&sink.lock);
+}
 
-HANDLER(decreqtparm) /* DECREQTPARM - Request Device Parameters */
-    SEND(n, P0(0)? "\033[3;1;2;120;1;0x" : "\033[2;1;2;120;128;1;0x");
-ENDHANDLER
+static bool
+startpump(void) /* Give curses a pipe to write to, and start the pump. */
+{
+    int out[2];
+    pthread_t t;
+    if (pipe(out) != 0 || pipe(sink.wake) != 0)
+        return false;
+    int fds[] = {out[0], out[1], sink.wake[0], sink.wake[1]};
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++){
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        if (fds[i] != out[1]) /* curses' end has to block */
+            fcntl(fds[i], F_SETFL, O_NONBLOCK);
+    }
+    sink.out = out[0];
+    dup2(out[1], session.host);
+    close(out[1]);
+    return pthread_create(&t, NULL, pump, NULL) == 0 && pthread_detach(t) == 0;
+}
 
-HANDLER(sgr0) /* Reset SGR to default */
-    wattrset(win, A_NORMAL);
-    wcolor_set(win, 0, NULL);
-    s->fg = s->bg = -1;
-    wbkgdset(win, COLOR_PAIR(0) | ' ');
-ENDHANDLER
+static void
+watchclient(bool on) /* Turn input notification for the client on or off. */
+{
+    #ifdef __linux__
+    struct epoll_event e = {.events = on? EPOLLIN : 0, .data.ptr = NULL};
+    epoll_ctl(epfd, EPOLL_CTL_MOD, session.client, &e);
+    #else
+    pfds[clientslot].fd = session.client;
+    pfds[clientslot].events = on? POLLIN : 0;
+    #endif
+}
 
-HANDLER(cls) /* Clear screen */
-    CALL(cup);
-    wclrtobot(win);
-    CALL(cup);
-ENDHANDLER
+static void
+repaint(NODE *n) /* Mark every row of every view under n as changed. */
+{
+    if (n->t != VIEW){
+        repaint(n->c1);
+        repaint(n->c2);
+    } else{
+        touchwin(n->s->win); /* curses only copies what it thinks changed */
+        touch(n, 0, n->h - 1);
+        n->scrolled = 0; /* what came before doesn't make this a flood */
+    }
+}
 
-HANDLER(ris) /* RIS - Reset to Initial State */
-    n->gs = n->gc = n->g0 = CSET_US; n->g1 = CSET_GRAPH;
-    n->g2 = CSET_US; n->g3 = CSET_GRAPH;
-    n->decom = s->insert = s->oxenl = s->xenl = n->lnm = false;
-    CALL(cls);
-    CALL(sgr0);
-    n->am = n->pnm = true;
-    n->pri.vis = n->alt.vis = 1;
-    n->s = &n->pri;
-    wsetscrreg(n->pri.win, 0, MAX(SCROLLBACK, n->h) - 1);
-    wsetscrreg(n->alt.win, 0, n->h - 1);
-    for (int i = 0; i < n->ntabs; i++)
-        n->tabs[i] = (i % 8 == 0);
-ENDHANDLER
+static void
+detach(void) /* Let go of the attached client, if there is one. */
+{
+    if (session.client < 0)
+        return;
+    endwin(); /* the client's terminal is left as it was found */
+    switchclient(-1);
+    #ifdef __linux__
+    epoll_ctl(epfd, EPOLL_CTL_DEL, session.client, NULL);
+    #else
+    pfds[clientslot].fd = -1;
+    #endif
+    close(session.client);
+    session.client = -1;
+    session.len = session.left = 0;
+}
 
-HANDLER(mode) /* Set or Reset Mode */
-    bool set = (w == L'h');
-    for (int i = 0; i < argc; i++) switch (P0(i)){
-        case  1: n->pnm = set;              break;
-        case  3: CALL(cls);                 break;
-        case  4: s->insert = set;           break;
-        case  6: n->decom = set; CALL(cup); break;
-        case  7: n->am = set;               break;
-        case 20: n->lnm = set;              break;
-        case 25: s->vis = set? 1 : 0;       break;
-        case 34: s->vis = set? 1 : 2;       break;
-        case 1048: CALL((set? sc : rc));    break;
-        case 1049:
-            CALL((set? sc : rc)); /* fall-through */
-        case 47: case 1047: if (set && n->s != &n->alt){
-                n->s = &n->alt;
-                CALL(cls);
-            } else if (!set && n->s != &n->pri)
-                n->s = &n->pri;
-            break;
-    }
-ENDHANDLER
+static void
+attach(int fd) /* Start drawing the screen for the client on fd. */
+{
+    detach();
+    if (!isendwin())
+        endwin(); /* so that the next update sets the terminal up again */
+    fcntl(fd, F_SETFD, FD_CLOEXEC); /* views' programs don't get it */
+    switchclient(fd);
+    session.client = fd;
+    session.sized = false; /* nothing's drawn until it has */
+    #ifdef __linux__
+    struct epoll_event e = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e);
+    #else
+    pfds[clientslot].fd = fd;
+    pfds[clientslot].events = POLLIN;
+    #endif
+    relayout = true;
+    clearok(curscr, TRUE);
+    repaint(root); /* the new client sees everything once */
+}
 
-HANDLER(sgr) /* SGR - Select Graphic Rendition */
-    bool doc = false, do8 = COLORS >= 8, do16 = COLORS >= 16, do256 = COLORS >= 256;
-    if (!argc)
-        CALL(sgr0);
+int restartterm(NCURSES_CONST char *, int, int *); /* term.h's macros clash */
 
-    short bg = s->bg, fg = s->fg;
-    for (int i = 0; i < argc; i++) switch (P0(i)){
-        case  0:  CALL(sgr0);                                              break;
-        case  1:  wattron(win,  A_BOLD);                                   break;
-        case  2:  wattron(win,  A_DIM);                                    break;
-        case  4:  wattron(win,  A_UNDERLINE);                              break;
-        case  5:  wattron(win,  A_BLINK);                                  break;
-        case  7:  wattron(win,  A_REVERSE);                                break;
-        case  8:  wattron(win,  A_INVIS);                                  break;
-        case 22:  wattroff(win, A_DIM); wattroff(win, A_BOLD);             break;
-        case 24:  wattroff(win, A_UNDERLINE);                              break;
-        case 25:  wattroff(win, A_BLINK);                                  break;
-        case 27:  wattroff(win, A_REVERSE);                                break;
-        case 30:  fg = COLOR_BLACK;                           doc = do8;   break;
-        case 31:  fg = COLOR_RED;                             doc = do8;   break;
-        case 32:  fg = COLOR_GREEN;                           doc = do8;   break;
-        case 33:  fg = COLOR_YELLOW;                          doc = do8;   break;
-        case 34:  fg = COLOR_BLUE;                            doc = do8;   break;
-        case 35:  fg = COLOR_MAGENTA;                         doc = do8;   break;
-        case 36:  fg = COLOR_CYAN;                            doc = do8;   break;
-        case 37:  fg = COLOR_WHITE;                           doc = do8;   break;
-        case 38:  fg = P0(i+1) == 5? P0(i+2) : s->fg; i += 2; doc = do256; break;
-        case 39:  fg = -1;                                    doc = true;  break;
-        case 40:  bg = COLOR_BLACK;                           doc = do8;   break;
-        case 41:  bg = COLOR_RED;                             doc = do8;   break;
-        case 42:  bg = COLOR_GREEN;                           doc = do8;   break;
-        case 43:  bg = COLOR_YELLOW;                          doc = do8;   break;
-        case 44:  bg = COLOR_BLUE;                            doc = do8;   break;
-        case 45:  bg = COLOR_MAGENTA;                         doc = do8;   break;
-        case 46:  bg = COLOR_CYAN;                            doc = do8;   break;
-        case 47:  bg = COLOR_WHITE;                           doc = do8;   break;
-        case 48:  bg = P0(i+1) == 5? P0(i+2) : s->bg; i += 2; doc = do256; break;
-        case 49:  bg = -1;                                    doc = true;  break;
-        case 90:  fg = COLOR_BLACK;                           doc = do16;  break;
-        case 91:  fg = COLOR_RED;                             doc = do16;  break;
-        case 92:  fg = COLOR_GREEN;                           doc = do16;  break;
-        case 93:  fg = COLOR_YELLOW;                          doc = do16;  break;
-        case 94:  fg = COLOR_BLUE;                            doc = do16;  break;
-        case 95:  fg = COLOR_MAGENTA;                         doc = do16;  break;
-        case 96:  fg = COLOR_CYAN;                            doc = do16;  break;
-        case 97:  fg = COLOR_WHITE;                           doc = do16;  break;
-        case 100: bg = COLOR_BLACK;                           doc = do16;  break;
-        case 101: bg = COLOR_RED;                             doc = do16;  break;
-        case 102: bg = COLOR_GREEN;                           doc = do16;  break;
-        case 103: bg = COLOR_YELLOW;                          doc = do16;  break;
-        case 104: bg = COLOR_BLUE;                            doc = do16;  break;
-        case 105: bg = COLOR_MAGENTA;                         doc = do16;  break;
-        case 106: bg = COLOR_CYAN;                            doc = do16;  break;
-        case 107: bg = COLOR_WHITE;                           doc = do16;  break;
-        #if defined(A_ITALIC) && !defined(NO_ITALICS )
-        case  3:  wattron(win,  A_ITALIC);                    break;
-        case 23:  wattroff(win, A_ITALIC);                    break;
-        #endif
+static void
+rehost(const char *t) /* Have curses draw for a terminal of type t. */
+{
+    static const struct{
+        const char *cap;
+        int key;
+    } keys[] ={
+        {"kcuu1", KEY_UP},   {"kcud1", KEY_DOWN}, {"kcub1", KEY_LEFT},
+        {"kcuf1", KEY_RIGHT}, {"khome", KEY_HOME}, {"kend", KEY_END},
+        {"kpp", KEY_PPAGE},  {"knp", KEY_NPAGE},  {"kich1", KEY_IC},
+        {"kdch1", KEY_DC},   {"kcbt", KEY_BTAB},  {"kbs", KEY_BACKSPACE},
+        {"kent", KEY_ENTER}
+    };
+    int lines = LINES, cols = COLS, err = 0;
+    if (!*t || !strcmp(t, session.term)
+            || restartterm((NCURSES_CONST char *)t, session.host, &err) != OK)
+        return; /* a type we don't know gets the last one's */
+    snprintf(session.term, sizeof(session.term), "%s", t);
+    resize_term(lines, cols); /* until the client says otherwise */
+    start_color();
+    use_default_colors();
+    fitcolors();
+
+    /* keys are decoded as the first terminal sent them, and now this one */
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++){
+        char *k = tigetstr(keys[i].cap);
+        if (k && k != (char *)-1 && *k)
+            define_key(k, keys[i].key);
     }
-    if (doc){
-        int p = alloc_pair(s->fg = fg, s->bg = bg);
-        wcolor_set(win, p, NULL);
-        cchar_t c;
-        setcchar(&c, L" ", A_NORMAL, p, NULL);
-        wbkgrndset(win, &c);
-   }
+    for (int i = 1; i <= 12; i++){
+        char cap[8], *k;
+        snprintf(cap, sizeof(cap), "kf%d", i);
+        if ((k = tigetstr(cap)) && k != (char *)-1 && *k)
+            define_key(k, KEY_F(i));
+    }
+    relayout = true;
+    clearok(curscr, TRUE);
+    repaint(root);
 }
 
-HANDLER(cr) /* CR - Carriage Return */
-    s->xenl = false;
-    wmove(win, py, 0);
-ENDHANDLER
+static void
+passkeys(void) /* Act on the MSGs buffered from the client. */
+{
+    size_t i = 0;
+    while (i < session.len){
+        if (session.left){
+            size_t c = MIN(session.left, session.len - i);
+            ssize_t w = write(session.keys, session.buf + i, c);
+            if (w <= 0)
+                break; /* the rest waits until curses reads some */
+            i += (size_t)w;
+            session.left -= (size_t)w;
+        } else if (session.len - i >= sizeof(MSG)){
+            MSG m;
+            memcpy(&m, session.buf + i, sizeof(m));
+            int tl = (int)sizeof(session.term) - 1; /* clients send no more */
+            size_t body = m.t == MSG_TERM? (size_t)MIN(MAX(m.len, 0), tl) : 0;
+            if (session.len - i < sizeof(m) + body)
+                break; /* the rest of it hasn't come yet */
+            i += sizeof(m);
+            if (m.t == MSG_KEYS)
+                session.left = (size_t)MAX(m.len, 0);
+            else if (m.t == MSG_TERM){
+                char t[sizeof(session.term)] = {0};
+                memcpy(t, session.buf + i, body);
+                i += body;
+                rehost(t);
+            }
+            else if (m.t == MSG_SIZE && m.rows > 0 && m.cols > 0){
+                record(REC_SIZE, NULL, m.rows, m.cols, NULL, 0);
+                session.sized = true;
+                resize_term(m.rows, m.cols);
+                reshape(root, 0, 0, layoutlines(), COLS);
+                relayout = true;
+                clearok(curscr, TRUE);
+                repaint(root);
+            }
+        } else
+            break;
+    }
+    memmove(session.buf, session.buf + i, session.len - i);
+    session.len -= i;
+}
 
-HANDLER(ind) /* IND - Index */
-    y == (bot - 1)? scroll(win) : wmove(win, py + 1, x);
-ENDHANDLER
+static bool
+serve(void) /* Take new clients and what they send; is there more to pass? */
+{
+    int fd = accept(session.listen, NULL, NULL);
+    if (fd >= 0)
+        attach(fd);
+    if (session.client < 0)
+        return false;
 
-HANDLER(nel) /* NEL - Next Line */
-    CALL(cr); CALL(ind);
-ENDHANDLER
+    if (session.len < sizeof(session.buf)){
+        ssize_t r = recv(session.client, session.buf + session.len,
+                         sizeof(session.buf) - session.len, MSG_DONTWAIT);
+        if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR))
+            return detach(), false;
+        session.len += r > 0? (size_t)r : 0;
+    }
+    passkeys();
+    watchclient(session.len < sizeof(session.buf));
+    return session.len > 0;
+}
 
-HANDLER(pnl) /* NL - Newline */
-    CALL((n->lnm? nel : ind));
-ENDHANDLER
+static bool
+startserver(void) /* Set up the screen for a server with no client yet. */
+{
+    int keys = -1, tty = -1;
+    struct termios t = {.c_cflag = CS8 | CREAD}; /* raw */
+    t.c_cc[VMIN] = 1;
+    if (openpty(&keys, &tty, NULL, &t, NULL) != 0)
+        return false;
 
-HANDLER(cpl) /* CPL - Cursor Previous Line */
-    wmove(win, MAX(tos + top, py - P1(0)), 0);
-ENDHANDLER
+    /* curses sets up the terminal through the fd it writes to, so it
+     * starts out writing to the key pty, where that works */
+    FILE *out = fdopen(dup(tty), "w"), *in = fdopen(tty, "r");
+    if (!out || !in || !newterm(getenv("TERM"), out, in) || raw() != OK)
+        return false;
+    if (getenv("TERM"))
+        snprintf(session.term, sizeof(session.term), "%s", getenv("TERM"));
+    session.keys = keys;
+    session.host = fileno(out);
+    if (!startpump())
+        return false;
+    keyfd = tty;
 
-HANDLER(cnl) /* CNL - Cursor Next Line */
-    wmove(win, MIN(tos + bot - 1, py + P1(0)), 0);
-ENDHANDLER
+    int fds[] = {keys, tty, session.host, session.listen};
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    fcntl(keys, F_SETFL, O_NONBLOCK);
+    fcntl(session.listen, F_SETFL, O_NONBLOCK);
+    signal(SIGPIPE, SIG_IGN); /* a client that's gone is noticed by reading */
+    #ifndef __linux__
+    clientslot = npfds;
+    if (!watch(NULL, -1))
+        return false;
+    #endif
+    return watch(NULL, session.listen); /* serve() takes it from there */
+}
 
-HANDLER(print) /* Print a character to the terminal */
-    if (wcwidth(w) < 0)
-        return;
+static void
+tellserver(int s, Msg t, const char *b, int len) /* Send a MSG to the server. */
+{
+    struct winsize ws = {0};
+    MSG m = {.t = t, .len = len};
+    if (t == MSG_SIZE && ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == 0)
+        m.rows = ws.ws_row, m.cols = ws.ws_col;
+    if (write(s, &m, sizeof(m)) == sizeof(m))
+        for (ssize_t w = 0; len > 0; b += w, len -= (int)w)
+            if ((w = write(s, b, (size_t)len)) <= 0)
+                return;
+}
 
-    if (s->insert)
-        CALL(ich);
+static void
+handlewinch(int sig) /* The client's terminal has changed size. */
+{
+    (void)sig;
+    resized = 1;
+}
 
-    if (s->xenl){
-        s->xenl = false;
-        if (n->am)
-            CALL(nel);
-        getyx(win, y, x);
-        y -= tos;
+static void
+client(int s) /* Pass keys to the session on s, and its screen back. */
+{
+    struct termios raw, old;
+    bool tty = tcgetattr(STDIN_FILENO, &old) == 0;
+    if (tty){
+        raw = old;
+        raw.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR
+                         | ICRNL | IXON);
+        raw.c_oflag &= ~OPOST;
+        raw.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+        raw.c_cflag = (raw.c_cflag & ~(CSIZE | PARENB)) | CS8;
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
     }
+    struct sigaction sa = {.sa_handler = handlewinch};
+    sigaction(SIGWINCH, &sa, NULL);
+    fputs("\033[?2004h", stdout); /* pastes are marked, as mtm itself does */
+    fflush(stdout);
 
-    if (w < MAXMAP && n->gc[w])
-        w = n->gc[w];
-    n->repc = w;
+    struct pollfd p[] = {{.fd = STDIN_FILENO, .events = POLLIN},
+                         {.fd = s, .events = POLLIN}};
+    const char *t = getenv("TERM");
+    if (t && strlen(t) < sizeof(session.term)) /* the server draws for it */
+        tellserver(s, MSG_TERM, t, (int)strlen(t));
+    tellserver(s, MSG_SIZE, NULL, 0);
+    while (true){
+        if (resized){
+            resized = 0;
+            tellserver(s, MSG_SIZE, NULL, 0);
+        }
+        if (poll(p, 2, -1) < 0)
+            continue;
+        ssize_t r = 0;
+        if (p[1].revents){
+            if ((r = read(s, iobuf, sizeof(iobuf))) <= 0)
+                break;
+            for (ssize_t w = 0, o = 0; o < r; o += w)
+                if ((w = write(STDOUT_FILENO, iobuf + o, r - o)) <= 0)
+                    break;
+        }
+        if (p[0].revents){
+            if ((r = read(STDIN_FILENO, iobuf, sizeof(iobuf))) <= 0)
+                break;
+            tellserver(s, MSG_KEYS, iobuf, (int)r);
+        }
+    }
 
-    if (x == mx - wcwidth(w)){
-        s->xenl = true;
-        wins_nwstr(win, &w, 1);
-    } else
-        waddnwstr(win, &w, 1);
-    n->gc = n->gs;
-} /* no ENDHANDLER because we don't want to reset repc */
+    fputs("\033[?2004l", stdout);
+    fflush(stdout);
+    if (tty)
+        tcsetattr(STDIN_FILENO, TCSAFLUSH, &old);
+    exit(EXIT_SUCCESS);
+}
 
-HANDLER(rep) /* REP - Repeat Character */
-    for (int i = 0; i < P1(0) && n->repc; i++)
-        print(v, p, n->repc, 0, 0, NULL, NULL);
-ENDHANDLER
+static void
+opensession(const char *name) /* Attach to name, starting a server if need be. */
+{
+    static char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    char dir[sizeof(path)] = {0};
+    struct sockaddr_un a = {.sun_family = AF_UNIX};
+    struct stat st;
+    if (!*name || strchr(name, '/'))
+        quit(EXIT_FAILURE, "session names can't be empty or contain '/'");
+    if (!userdir(dir, sizeof(dir)))
+        quit(EXIT_FAILURE, "could not make a private directory for sessions");
+    if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path))
+        quit(EXIT_FAILURE, "session name too long");
+    strcpy(a.sun_path, path);
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s < 0)
+        quit(EXIT_FAILURE, "could not create socket");
+    if (connect(s, (struct sockaddr *)&a, sizeof(a)) == 0)
+        client(s);
+    if (errno != ECONNREFUSED && errno != ENOENT)
+        quit(EXIT_FAILURE, "could not connect to session");
 
-HANDLER(scs) /* Select Character Set */
-    wchar_t **t = NULL;
-    switch (iw){
-        case L'(': t = &n->g0;  break;
-        case L')': t = &n->g1;  break;
-        case L'*': t = &n->g2;  break;
-        case L'+': t = &n->g3;  break;
-        default: return;        break;
-    }
-    switch (w){
-        case L'A': *t = CSET_UK;    break;
-        case L'B': *t = CSET_US;    break;
-        case L'0': *t = CSET_GRAPH; break;
-        case L'1': *t = CSET_US;    break;
-        case L'2': *t = CSET_GRAPH; break;
-    }
-ENDHANDLER
+    if (lstat(path, &st) == 0 && !S_ISSOCK(st.st_mode))
+        quit(EXIT_FAILURE, "session path exists and isn't a socket");
+    unlink(path); /* if it's there, nobody's listening on it any more */
+    mode_t mask = umask(077);
+    int l = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool ok = l >= 0 && bind(l, (struct sockaddr *)&a, sizeof(a)) == 0
+           && listen(l, 4) == 0;
+    umask(mask);
+    if (!ok)
+        quit(EXIT_FAILURE, "could not create session");
 
-HANDLER(so) /* Switch Out/In Character Set */
-    if (w == 0x0e)
-        n->gs = n->gc = n->g1; /* locking shift */
-    else if (w == 0xf)
-        n->gs = n->gc = n->g0; /* locking shift */
-    else if (w == L'n')
-        n->gs = n->gc = n->g2; /* locking shift */
-    else if (w == L'o')
-        n->gs = n->gc = n->g3; /* locking shift */
-    else if (w == L'N'){
-        n->gs = n->gc; /* non-locking shift */
-        n->gc = n->g2;
-    } else if (w == L'O'){
-        n->gs = n->gc; /* non-locking shift */
-        n->gc = n->g3;
+    pid_t pid = fork();
+    if (pid < 0)
+        quit(EXIT_FAILURE, "could not start session");
+    else if (pid > 0){ /* the client; the server's already listening */
+        close(l);
+        if (connect(s, (struct sockaddr *)&a, sizeof(a)) != 0)
+            quit(EXIT_FAILURE, "could not connect to session");
+        client(s);
     }
-ENDHANDLER
 
-static void
-setupevents(NODE *n)
-{
-    n->vp.p = n;
-    vtonevent(&n->vp, VTPARSER_CONTROL, 0x05, ack);
-    vtonevent(&n->vp, VTPARSER_CONTROL, 0x07, bell);
-    vtonevent(&n->vp, VTPARSER_CONTROL, 0x08, cub);
-    vtonevent(&n->vp, VTPARSER_CONTROL, 0x09, tab);
-    vtonevent(&n->vp, VTPARSER_CONTROL, 0x0a, pnl);
-    vtonevent(&n->vp, VTPARSER_CONTROL, 0x0b, pnl);
-    vtonevent(&n->vp, VTPARSER_CONTROL, 0x0c, pnl);
-    vtonevent(&n->vp, VTPARSER_CONTROL, 0x0d, cr);
-    vtonevent(&n->vp, VTPARSER_CONTROL, 0x0e, so);
-    vtonevent(&n->vp, VTPARSER_CONTROL, 0x0f, so);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'A', cuu);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'B', cud);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'C', cuf);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'D', cub);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'E', cnl);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'F', cpl);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'G', hpa);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'H', cup);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'I', tab);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'J', ed);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'K', el);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'L', idl);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'M', idl);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'P', dch);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'S', su);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'T', su);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'X', ech);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'Z', tab);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'`', hpa);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'^', su);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'@', ich);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'a', hpr);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'b', rep);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'c', decid);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'd', vpa);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'e', vpr);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'f', cup);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'g', tbc);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'h', mode);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'l', mode);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'm', sgr);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'n', dsr);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'r', csr);
-    vtonevent(&n->vp, VTPARSER_CSI,     L's', sc);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'u', rc);
-    vtonevent(&n->vp, VTPARSER_CSI,     L'x', decreqtparm);
-    vtonevent(&n->vp, VTPARSER_ESCAPE,  L'0', scs);
-    vtonevent(&n->vp, VTPARSER_ESCAPE,  L'1', scs);
-    vtonevent(&n->vp, VTPARSER_ESCAPE,  L'2', scs);
-    vtonevent(&n->vp, VTPARSER_ESCAPE,  L'7', sc);
-    vtonevent(&n->vp, VTPARSER_ESCAPE,  L'8', rc);
-    vtonevent(&n->vp, VTPARSER_ESCAPE,  L'A', scs);
-    vtonevent(&n->vp, VTPARSER_ESCAPE,  L'B', scs);
-    vtonevent(&n->vp, VTPARSER_ESCAPE,  L'D', ind);
-    vtonevent(&n->vp, VTPARSER_ESCAPE,  L'E', nel);
-    vtonevent(&n->vp, VTPARSER_ESCAPE,  L'H', hts);
-    vtonevent(&n->vp, VTPARSER_ESCAPE,  L'M', ri);
-    vtonevent(&n->vp, VTPARSER_ESCAPE,  L'Z', decid);
-    vtonevent(&n->vp, VTPARSER_ESCAPE,  L'c', ris);
-    vtonevent(&n->vp, VTPARSER_ESCAPE,  L'p', vis);
-    vtonevent(&n->vp, VTPARSER_ESCAPE,  L'=', numkp);
-    vtonevent(&n->vp, VTPARSER_ESCAPE,  L'>', numkp);
-    vtonevent(&n->vp, VTPARSER_PRINT,   0,    print);
+    int null = open("/dev/null", O_RDWR);
+    close(s);
+    setsid(); /* the server outlives the terminal it was started from */
+    signal(SIGHUP, SIG_IGN);
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    close(null);
+    session.listen = l;
+    sessionpath = path;
 }
 
 /*** MTM FUNCTIONS
@@ -700,7 +3220,7 @@ newnode(Node t, NODE *p, int y, int x, int h, int w) /* Create a new node. */
         return free(n), free(tabs), NULL;
 
     n->t = t;
-    n->pt = -1;
+    n->pt = n->slot = -1;
     n->p = p;
     n->y = y;
     n->x = x;
@@ -708,6 +3228,8 @@ newnode(Node t, NODE *p, int y, int x, int h, int w) /* Create a new node. */
     n->w = w;
     n->tabs = tabs;
     n->ntabs = w;
+    n->dlo = 0;
+    n->dhi = h - 1;
 
     return n;
 }
@@ -718,17 +3240,38 @@ freenode(NODE *n, bool recurse) /* Free a node. */
     if (n){
         if (lastfocused == n)
             lastfocused = NULL;
+        for (int i = 0; i < nwins; i++) if (wins[i].lastfocused == n)
+            wins[i].lastfocused = NULL;
         if (n->pri.win)
             delwin(n->pri.win);
         if (n->alt.win)
             delwin(n->alt.win);
+        if (n->hwin)
+            delwin(n->hwin);
+        if (search.n == n)
+            search.n = NULL;
+        if (paste.to == n)
+            paste.to = NULL;
+        if (typed.from == n){
+            typed.from = NULL;
+            typed.len = 0;
+        }
+        if (n->marked)
+            nmarked--;
+        histclear(n);
+        free(n->hist);
+        free(n->segs);
+        free(n->bloom);
+        free(n->out);
+        free(n->osc);
+        free(n->title);
         if (recurse)
             freenode(n->c1, true);
         if (recurse)
             freenode(n->c2, true);
         if (n->pt >= 0){
+            unwatch(n);
             close(n->pt);
-            FD_CLR(n->pt, &fds);
         }
         free(n->tabs);
         free(n);
@@ -738,12 +3281,22 @@ freenode(NODE *n, bool recurse) /* Free a node. */
 static void
 fixcursor(void) /* Move the terminal cursor to the active view. */
 {
-    if (focused){
+    static int cy, cx; /* where it was, while the view is held */
+    if (focused && search.n == focused){ /* at the end of the query */
+        curs_set(1);
+        setsyx(focused->y + focused->h - 1,
+               focused->x + MIN(search.px, focused->w - 1));
+    } else if (focused && syncing(focused))
+        setsyx(cy, cx);
+    else if (focused){
         int y, x;
-        curs_set(focused->s->off != focused->s->tos? 0 : focused->s->vis);
+        curs_set(focused->s->off? 0 : focused->s->vis);
         getyx(focused->s->win, y, x);
         y = MIN(MAX(y, focused->s->tos), focused->s->tos + focused->h - 1);
         wmove(focused->s->win, y, x);
+        cy = focused->y + y - focused->s->tos;
+        cx = focused->x + x;
+        setsyx(cy, cx);
     }
 }
 
@@ -765,21 +3318,24 @@ newview(NODE *p, int y, int x, int h, int w) /* Open a new view. */
     NODE *n = newnode(VIEW, p, y, x, h, w);
     if (!n)
         return NULL;
+    n->id = nextid++;
 
     SCRN *pri = &n->pri, *alt = &n->alt;
-    pri->win = newpad(MAX(h, SCROLLBACK), w);
+    pri->win = newpad(PADHEIGHT(h), w);
     alt->win = newpad(h, w);
     if (!pri->win || !alt->win)
         return freenode(n, false), NULL;
-    pri->tos = pri->off = MAX(0, SCROLLBACK - h);
     n->s = pri;
+    n->hmax = histmax;
 
     nodelay(pri->win, TRUE); nodelay(alt->win, TRUE);
     scrollok(pri->win, TRUE); scrollok(alt->win, TRUE);
     keypad(pri->win, TRUE); keypad(alt->win, TRUE);
 
-    setupevents(n);
+    vtinit(&n->vp, &callbacks, n);
     ris(&n->vp, n, L'c', 0, 0, NULL, NULL);
+    if (headless || playback)
+        return n;
 
     pid_t pid = forkpty(&n->pt, NULL, NULL, &ws);
     if (pid < 0){
@@ -797,9 +3353,9 @@ newview(NODE *p, int y, int x, int h, int w) /* Open a new view. */
         return NULL;
     }
 
-    FD_SET(n->pt, &fds);
     fcntl(n->pt, F_SETFL, O_NONBLOCK);
-    nfds = n->pt > nfds? n->pt : nfds;
+    if (!watch(n, n->pt))
+        return freenode(n, false), NULL;
     return n;
 }
 
@@ -825,6 +3381,8 @@ focus(NODE *n) /* Focus a node. */
     if (!n)
         return;
     else if (n->t == VIEW){
+        if (search.n && search.n == focused && n != focused)
+            endsearch(true);
         lastfocused = focused;
         focused = n;
     } else
@@ -848,194 +3406,630 @@ findnode(NODE *n, int y, int x) /* Find the node enclosing y,x. */
             return findnode(n->c2, y, x);
         return n;
     }
-    return NULL;
+    return NULL;
+}
+
+static int
+winof(NODE *n) /* Find the window n is in. */
+{
+    while (n->p)
+        n = n->p;
+    for (int i = 0; i < nwins; i++)
+        if ((i == curwin? root : wins[i].root) == n)
+            return i;
+    return curwin;
+}
+
+static void
+replacechild(NODE *n, NODE *c1, NODE *c2) /* Replace c1 of n with c2. */
+{
+    c2->p = n;
+    if (!n){ /* c1 was the top of its window */
+        int w = winof(c1);
+        *(w == curwin? &root : &wins[w].root) = c2;
+        if (w == curwin)
+            reshape(c2, 0, 0, layoutlines(), COLS);
+        else /* hidden windows keep their size until shown */
+            reshape(c2, c1->y, c1->x, c1->h, c1->w);
+    } else if (n->c1 == c1)
+        n->c1 = c2;
+    else if (n->c2 == c1)
+        n->c2 = c2;
+
+    n = n? n : c2;
+    reshape(n, n->y, n->x, n->h, n->w);
+}
+
+static void
+removechild(NODE *p, const NODE *c) /* Replace p with other child. */
+{
+    replacechild(p->p, p, c == p->c1? p->c2 : p->c1);
+    freenode(p, false);
+}
+
+static void
+loadwin(int i) /* Show window i, without saving the one that was shown. */
+{
+    curwin = i;
+    root = wins[i].root;
+    focused = wins[i].focused;
+    lastfocused = wins[i].lastfocused;
+    wins[i].active = false;
+    reshape(root, 0, 0, layoutlines(), COLS); /* it missed resizes while hidden */
+    repaint(root);
+    relayout = true;
+}
+
+static void
+showwin(int i) /* Switch to window i. */
+{
+    if (i == curwin || i < 0 || i >= nwins)
+        return;
+    if (search.n)
+        endsearch(true);
+    wins[curwin] = (WIN){root, focused, lastfocused, false};
+    loadwin(i);
+}
+
+static void
+openwin(void) /* Open a new window and switch to it. */
+{
+    WIN *w = realloc(wins, (nwins + 1) * sizeof(WIN));
+    if (!w)
+        return;
+    wins = w;
+    NODE *n = newview(NULL, 0, 0, LINES - 1, COLS); /* the list takes a row */
+    if (!n)
+        return;
+    wins[nwins++] = (WIN){n, n, NULL, false};
+    showwin(nwins - 1);
+}
+
+static void
+closewin(int i) /* Forget window i, now that its last view is gone. */
+{
+    wins[curwin] = (WIN){root, focused, lastfocused, false};
+    memmove(wins + i, wins + i + 1, (nwins - i - 1) * sizeof(WIN));
+    nwins--;
+    curwin -= curwin > i || curwin == nwins;
+    loadwin(curwin); /* the list may have gone, so this one can grow */
+}
+
+static void
+deletenode(NODE *n) /* Delete a node. */
+{
+    if (!n || (!n->p && nwins < 2))
+        quit(EXIT_SUCCESS, NULL);
+    int w = winof(n);
+    if (!n->p){
+        freenode(n, true);
+        closewin(w);
+        return;
+    }
+
+    NODE *o = n->p->c1 == n? n->p->c2 : n->p->c1;
+    if (n == focused)
+        focus(o);
+    else if (w != curwin && wins[w].focused == n){
+        while (o->t != VIEW)
+            o = o->c1? o->c1 : o->c2;
+        wins[w].focused = o;
+    }
+    removechild(n->p, n);
+    freenode(n, true);
+}
+
+static void
+reshapeview(NODE *n, int ow) /* Reshape a view. */
+{
+    int oy, ox, lost;
+    bool *tabs = newtabs(n->w, ow, n->tabs);
+    struct winsize ws = {.ws_row = n->h, .ws_col = n->w};
+
+    if (tabs){
+        free(n->tabs);
+        n->tabs = tabs;
+        n->ntabs = n->w;
+    }
+
+    compact(n);
+    getyx(n->pri.win, oy, ox);
+    lost = MAX(0, oy - (n->h - 1)); /* keep the cursor on the screen */
+    for (int i = 0; i < lost; i++)
+        histpush(n, i);
+    wsetscrreg(n->pri.win, 0, getmaxy(n->pri.win) - 1);
+    wscrl(n->pri.win, lost);
+
+    wresize(n->pri.win, PADHEIGHT(n->h), MAX(n->w, 2));
+    wresize(n->alt.win, MAX(n->h, 2), MAX(n->w, 2));
+    wsetscrreg(n->pri.win, 0, n->h - 1);
+    wsetscrreg(n->alt.win, 0, n->h - 1);
+    wmove(n->pri.win, oy - lost, MIN(ox, n->w - 1));
+    if (n->hwin)
+        delwin(n->hwin);
+    n->hwin = NULL;
+    touch(n, 0, n->h - 1);
+    ioctl(n->pt, TIOCSWINSZ, &ws);
+}
+
+static void
+reshapechildren(NODE *n) /* Reshape all children of a view. */
+{
+    if (n->t == HORIZONTAL){
+        int i = n->w % 2? 0 : 1;
+        reshape(n->c1, n->y, n->x, n->h, n->w / 2);
+        reshape(n->c2, n->y, n->x + n->w / 2 + 1, n->h, n->w / 2 - i);
+    } else if (n->t == VERTICAL){
+        int i = n->h % 2? 0 : 1;
+        reshape(n->c1, n->y, n->x, n->h / 2, n->w);
+        reshape(n->c2, n->y + n->h / 2 + 1, n->x, n->h / 2 - i, n->w);
+    }
+}
+
+static void
+reshape(NODE *n, int y, int x, int h, int w) /* Reshape a node. */
+{
+    if (n->y == y && n->x == x && n->h == h && n->w == w && n->t == VIEW)
+        return;
+
+    int ow = n->w;
+    n->y = y;
+    n->x = x;
+    n->h = MAX(h, 1);
+    n->w = MAX(w, 1);
+
+    if (n->t == VIEW)
+        reshapeview(n, ow);
+    else
+        reshapechildren(n);
+    relayout = true;
+}
+
+static void
+drawlines(NODE *n) /* Draw the separators under n, marking views to redraw. */
+{
+    if (n->t == VIEW){
+        touch(n, 0, n->h - 1);
+        n->jumped = 0.0; /* even flooding views are drawn right away */
+    } else{
+        if (n->t == HORIZONTAL)
+            mvvline(n->y, n->x + n->w / 2, ACS_VLINE, n->h);
+        else
+            mvhline(n->y + n->h / 2, n->x, ACS_HLINE, n->w);
+        drawlines(n->c1);
+        drawlines(n->c2);
+    }
+}
+
+static void
+drawhist(NODE *n, int rows) /* Draw the top rows of a scrolled-back view. */
+{
+    if (!n->hwin && !(n->hwin = newpad(n->h, n->w)))
+        return;
+    cchar_t *c = cells(n->w);
+    werase(n->hwin);
+    for (int i = 0; c && i < rows; i++){
+        const LINE *l = histget(n, histsize(n) - n->s->off + i);
+        if (l)
+            mvwadd_wchnstr(n->hwin, i, 0, c, unpack(l, c, n->w));
+    }
+    pnoutrefresh(n->hwin, 0, 0, n->y, n->x, n->y + rows - 1, n->x + n->w - 1);
+}
+
+static void
+drawsearch(NODE *n) /* Draw a view being searched, highlighting the matches. */
+{
+    if (!n->hwin && !(n->hwin = newpad(n->h, n->w)))
+        return;
+    int top = histsize(n) - n->s->off, s, e;
+    werase(n->hwin);
+    for (int i = 0; i < n->h - 1; i++){
+        LINE *tmp;
+        const LINE *l = textline(n, top + i, &tmp);
+        cchar_t *c = cells(n->w);
+        if (l && c){
+            int k = unpack(l, c, n->w);
+            const char *t = linetext(l);
+            for (int from = 0; matchfrom(t, from, &s, &e); from = e){
+                bool cur = n->hbase + top + i == search.match && s == search.ms;
+                for (int j = cellsbefore(l, s); j < MIN(cellsbefore(l, e), k); j++){
+                    restyle(&c[j], A_REVERSE, cur? A_BOLD | A_UNDERLINE : 0);
+                }
+            }
+            mvwadd_wchnstr(n->hwin, i, 0, c, k);
+        }
+        free(tmp);
+    }
+
+    wattron(n->hwin, A_REVERSE);
+    mvwprintw(n->hwin, n->h - 1, 0, "%s: ", search.regex? "regex" : "search");
+    waddwstr(n->hwin, search.q);
+    search.px = getcurx(n->hwin);
+    if (search.bad && search.nq)
+        waddstr(n->hwin, " (bad regex)");
+    else if (search.status)
+        wprintw(n->hwin, " (%s)", search.status);
+    wattroff(n->hwin, A_REVERSE);
+    pnoutrefresh(n->hwin, 0, 0, n->y, n->x, n->y + n->h - 1, n->x + n->w - 1);
+}
+
+static bool
+jumping(NODE *n) /* Should drawing n wait, since it's flooding? */
+{
+    bool flood = n->scrolled > JUMP_SCREENS * n->h;
+    n->scrolled = 0;
+    if (n->jumping && !flood){ /* it's over, and the marker has to go */
+        n->jumping = false;
+        touchline(n->s->win, n->s->tos, 1);
+        touch(n, 0, 0);
+    }
+    n->jumping |= flood;
+    held |= n->jumping;
+    return n->jumping && now() < n->jumped + JUMP_MS / 1000.0;
+}
+
+static bool
+syncing(NODE *n) /* Is n in the middle of a synchronized update? */
+{
+    return n->sync && now() < n->synced + SYNC_MS / 1000.0;
+}
+
+static void
+drawmark(NODE *n, const char *t) /* Label a view in its top right corner. */
+{
+    static WINDOW *label;
+    int len = MIN((int)strlen(t), n->w);
+    if (!label && !(label = newpad(1, 32)))
+        return;
+    werase(label);
+    wattrset(label, A_REVERSE);
+    mvwaddnstr(label, 0, 0, t, 32);
+    pnoutrefresh(label, 0, 0, n->y, n->x + n->w - len, n->y, n->x + n->w - 1);
+}
+
+static void
+drawview(NODE *n) /* Draw the changed rows of a view. */
+{
+    if (search.n == n)
+        drawsearch(n);
+    else{
+        int o = MIN(n->s->off, n->h); /* scrolled back: every row has moved */
+        int lo = o? o : n->dlo, hi = o? n->h - 1 : n->dhi;
+        if (o)
+            drawhist(n, o);
+        if (lo <= hi)
+            pnoutrefresh(n->s->win, n->s->tos + lo - o, 0, n->y + lo, n->x,
+                         n->y + hi, n->x + n->w - 1);
+        if (n->jumping){
+            drawmark(n, " jump scroll ");
+            n->jumped = now();
+        } else if (broadcast && (!nmarked || n->marked))
+            drawmark(n, " broadcast ");
+        else if (n->marked)
+            drawmark(n, " marked ");
+    }
+    n->dlo = n->h;
+    n->dhi = -1;
+}
+
+static void
+draw(NODE *n) /* Draw the changed rows of a node. */
+{
+    if (n->t != VIEW){
+        draw(n->c1);
+        draw(n->c2);
+    } else if (jumping(n))
+        return; /* the lines in between only go to scrollback */
+    else if (syncing(n))
+        held = true; /* half a frame isn't worth showing */
+    else if (n->dlo <= n->dhi){
+        double start = now();
+        drawview(n);
+        n->st.draw += now() - start;
+        n->st.frames++;
+    }
+}
+
+static void
+drawlist(void) /* Draw the list of windows, and the title, on the bottom row. */
+{
+    int from = curwin, w = 0, y, x;
+    char b[32];
+    if (nwins < 2 && !STATUS_LINE)
+        return;
+    for (int i = curwin; i >= 0; i--) /* scroll the list to keep curwin in it */
+        if ((w += snprintf(b, sizeof(b), " %d* ", i + 1)) <= COLS)
+            from = i;
+    move(LINES - 1, 0);
+    for (int i = from; i < nwins; i++){
+        attrset(i == curwin? A_REVERSE : wins[i].active? A_BOLD : A_NORMAL);
+        printw(" %d%s ", i + 1, i != curwin && wins[i].active? "*" : "");
+    }
+    attrset(A_NORMAL);
+
+    const wchar_t *t = focused && focused->title? focused->title : L"";
+    int k = (int)wcslen(t);
+    getyx(stdscr, y, x);
+    while (k && wcswidth(t, k) > COLS - x - 2)
+        k--;
+    if (k)
+        mvaddnwstr(y, COLS - 1 - wcswidth(t, k), t, k);
+}
+
+static bool
+retitled(void) /* Has the focused view's title changed since it was shown? */
+{
+    static wchar_t shown[TITLE_SIZE];
+    const wchar_t *t = focused && focused->title? focused->title : L"";
+    if (!wcscmp(t, shown))
+        return false;
+    wcscpy(shown, t);
+    return true;
+}
+
+static void
+split(NODE *n, Node t) /* Split a node. */
+{
+    int nh = t == VERTICAL? (n->h - 1) / 2 : n->h;
+    int nw = t == HORIZONTAL? (n->w) / 2 : n->w;
+    NODE *p = n->p;
+    NODE *v = newview(NULL, 0, 0, MAX(0, nh), MAX(0, nw));
+    if (!v)
+        return;
+
+    NODE *c = newcontainer(t, n->p, n->y, n->x, n->h, n->w, n, v);
+    if (!c){
+        freenode(v, false);
+        return;
+    }
+
+    replacechild(p, n, c);
+    focus(v);
 }
 
 static void
-replacechild(NODE *n, NODE *c1, NODE *c2) /* Replace c1 of n with c2. */
+parse(NODE *n, const char *b, size_t len) /* Feed output to n's terminal. */
 {
-    c2->p = n;
-    if (!n){
-        root = c2;
-        reshape(c2, 0, 0, LINES, COLS);
-    } else if (n->c1 == c1)
-        n->c1 = c2;
-    else if (n->c2 == c1)
-        n->c2 = c2;
+    jump.shy = NULL;
+    vtwrite(&n->vp, b, len);
+    settle(n); /* the pad might be drawn next */
+}
 
-    n = n? n : root;
-    reshape(n, n->y, n->x, n->h, n->w);
-    draw(n);
+static ssize_t
+getinput(NODE *n, size_t budget, double deadline) /* Drain n's pty. */
+{
+    size_t t = 0;
+    while (t < budget && now() < deadline){
+        ssize_t r = read(n->pt, iobuf, MIN(sizeof(iobuf), budget - t));
+        if (r > 0){
+            record(REC_OUTPUT, n, 0, 0, iobuf, (uint32_t)r);
+            double start = now();
+            parse(n, iobuf, r);
+            n->st.parse += now() - start;
+            n->st.read += r;
+            t += r;
+        } else if (r < 0 && errno == EINTR)
+            continue;
+        else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else
+            return -1; /* the caller records n closing and deletes it */
+    }
+    if (t)
+        n->active = now();
+    return (ssize_t)t;
 }
 
 static void
-removechild(NODE *p, const NODE *c) /* Replace p with other child. */
+scrollback(NODE *n)
 {
-    replacechild(p->p, p, c == p->c1? p->c2 : p->c1);
-    freenode(p, false);
+    n->s->off = MIN(n->s == &n->pri? histsize(n) : 0, n->s->off + n->h / 2);
+    touch(n, 0, n->h - 1);
 }
 
 static void
-deletenode(NODE *n) /* Delete a node. */
+scrollforward(NODE *n)
 {
-    if (!n || !n->p)
-        quit(EXIT_SUCCESS, NULL);
-    if (n == focused)
-        focus(n->p->c1 == n? n->p->c2 : n->p->c1);
-    removechild(n->p, n);
-    freenode(n, true);
+    n->s->off = MAX(0, n->s->off - n->h / 2);
+    touch(n, 0, n->h - 1);
 }
 
 static void
-reshapeview(NODE *n, int d, int ow) /* Reshape a view. */
+scrollbottom(NODE *n)
 {
-    int oy, ox;
-    bool *tabs = newtabs(n->w, ow, n->tabs);
-    struct winsize ws = {.ws_row = n->h, .ws_col = n->w};
-
-    if (tabs){
-        free(n->tabs);
-        n->tabs = tabs;
-        n->ntabs = n->w;
-    }
+    if (n->s->off)
+        touch(n, 0, n->h - 1);
+    n->s->off = 0;
+    unmapspill(n);
+}
 
-    getyx(n->s->win, oy, ox);
-    wresize(n->pri.win, MAX(n->h, SCROLLBACK), MAX(n->w, 2));
-    wresize(n->alt.win, MAX(n->h, 2), MAX(n->w, 2));
-    n->pri.tos = n->pri.off = MAX(0, SCROLLBACK - n->h);
-    n->alt.tos = n->alt.off = 0;
-    wsetscrreg(n->pri.win, 0, MAX(SCROLLBACK, n->h) - 1);
-    wsetscrreg(n->alt.win, 0, n->h - 1);
-    if (d > 0){ /* make sure the new top line syncs up after reshape */
-        wmove(n->s->win, oy + d, ox);
-        wscrl(n->s->win, -d);
-    }
-    doupdate();
-    refresh();
-    ioctl(n->pt, TIOCSWINSZ, &ws);
+static void
+showmatch(NODE *n) /* Scroll n so that the current match is in view. */
+{
+    int hs = histsize(n), top = hs - n->s->off;
+    long i = search.match - n->hbase;
+    if (i < top || i > top + n->h - 2)
+        n->s->off = (int)MIN(MAX(hs - (i - (n->h - 1) / 2), 0), hs);
+    touch(n, 0, n->h - 1);
 }
 
 static void
-reshapechildren(NODE *n) /* Reshape all children of a view. */
+refind(NODE *n) /* Search again from the start, after the query changed. */
 {
-    if (n->t == HORIZONTAL){
-        int i = n->w % 2? 0 : 1;
-        reshape(n->c1, n->y, n->x, n->h, n->w / 2);
-        reshape(n->c2, n->y, n->x + n->w / 2 + 1, n->h, n->w / 2 - i);
-    } else if (n->t == VERTICAL){
-        int i = n->h % 2? 0 : 1;
-        reshape(n->c1, n->y, n->x, n->h / 2, n->w);
-        reshape(n->c2, n->y + n->h / 2 + 1, n->x, n->h / 2 - i, n->w);
-    }
+    setquery();
+    n->s->off = MIN(search.origoff, histsize(n));
+    search.match = -1;
+    search.status = NULL;
+    if (search.nq && !search.bad && findmatch(n, search.origin, INT_MAX, -1))
+        showmatch(n);
+    else if (search.nq && !search.bad)
+        search.status = "no match";
+    touch(n, 0, n->h - 1);
 }
 
 static void
-reshape(NODE *n, int y, int x, int h, int w) /* Reshape a node. */
+startsearch(NODE *n) /* Start searching n's scrollback and screen. */
 {
-    if (n->y == y && n->x == x && n->h == h && n->w == w && n->t == VIEW)
+    if (n->s != &n->pri)
         return;
-
-    int d = n->h - h;
-    int ow = n->w;
-    n->y = y;
-    n->x = x;
-    n->h = MAX(h, 1);
-    n->w = MAX(w, 1);
-
-    if (n->t == VIEW)
-        reshapeview(n, d, ow);
-    else
-        reshapechildren(n);
-    draw(n);
+    search.n = n;
+    search.nq = 0;
+    search.origoff = n->s->off;
+    search.origin = n->hbase + histsize(n) - n->s->off + n->h - 1;
+    refind(n);
 }
 
 static void
-drawchildren(const NODE *n) /* Draw all children of n. */
+endsearch(bool keep) /* Stop searching, staying at the match if keep. */
 {
-    draw(n->c1);
-    if (n->t == HORIZONTAL)
-        mvvline(n->y, n->x + n->w / 2, ACS_VLINE, n->h);
-    else
-        mvhline(n->y + n->h / 2, n->x, ACS_HLINE, n->w);
-    wnoutrefresh(stdscr);
-    draw(n->c2);
+    NODE *n = search.n;
+    if (!n)
+        return;
+    if (!keep)
+        n->s->off = MIN(search.origoff, histsize(n));
+    search.n = NULL;
+    touch(n, 0, n->h - 1);
 }
 
 static void
-draw(NODE *n) /* Draw a node. */
+editsearch(NODE *n, wchar_t k) /* Add k to the query, or delete if k is 0. */
 {
-    if (n->t == VIEW)
-        pnoutrefresh(n->s->win, n->s->off, 0, n->y, n->x,
-                     n->y + n->h - 1, n->x + n->w - 1);
-    else
-        drawchildren(n);
+    if (k && search.nq < MAXQUERY)
+        search.q[search.nq++] = k;
+    else if (!k && search.nq)
+        search.nq--;
+    refind(n);
 }
 
 static void
-split(NODE *n, Node t) /* Split a node. */
+stepsearch(NODE *n, int dir) /* Move to the next older or newer match. */
 {
-    int nh = t == VERTICAL? (n->h - 1) / 2 : n->h;
-    int nw = t == HORIZONTAL? (n->w) / 2 : n->w;
-    NODE *p = n->p;
-    NODE *v = newview(NULL, 0, 0, MAX(0, nh), MAX(0, nw));
-    if (!v)
+    long line = search.match < n->hbase? search.origin : search.match;
+    int at = dir > 0? 0 : INT_MAX;
+    if (search.match >= n->hbase)
+        at = dir > 0? search.ms + 1 : search.ms;
+    if (!search.nq || search.bad)
         return;
+    if (findmatch(n, line, at, dir)){
+        search.status = NULL;
+        showmatch(n);
+    } else
+        search.status = dir > 0? "no newer match" : "no older match";
+    touch(n, 0, n->h - 1);
+}
 
-    NODE *c = newcontainer(t, n->p, n->y, n->x, n->h, n->w, n, v);
-    if (!c){
-        freenode(v, false);
-        return;
+/* While broadcasting, what's typed into the focused view goes to the
+ * marked views too, in any window, or if none are marked, to every view
+ * in the current window. It's collected as it's typed, and queued for
+ * the others once per batch of keys, so each gets one write. Like any
+ * view, one that isn't reading has what doesn't fit in its queue dropped,
+ * rather than holding up the rest.
+ */
+static void
+fanout(NODE *n) /* Queue the batch of typed keys for the views under n. */
+{
+    if (n->t != VIEW){
+        fanout(n->c1);
+        fanout(n->c2);
+    } else if (n != typed.from && (!nmarked || n->marked)){
+        scrollbottom(n);
+        queue(n, typed.b, typed.len);
     }
-
-    replacechild(p, n, c);
-    focus(v);
-    draw(p? p : root);
 }
 
-static bool
-getinput(NODE *n, fd_set *f) /* Recursively check all ptty's for input. */
+static void
+broadcastkeys(void) /* Send the batch of typed keys on. */
 {
-    if (n && n->c1 && !getinput(n->c1, f))
-        return false;
-
-    if (n && n->c2 && !getinput(n->c2, f))
-        return false;
-
-    if (n && n->t == VIEW && n->pt > 0 && FD_ISSET(n->pt, f)){
-        ssize_t r = read(n->pt, iobuf, sizeof(iobuf));
-        if (r > 0)
-            vtwrite(&n->vp, iobuf, r);
-        if (r <= 0 && errno != EINTR && errno != EWOULDBLOCK)
-            return deletenode(n), false;
+    if (typed.len && nmarked)
+        for (int i = 0; i < nwins; i++)
+            fanout(i == curwin? root : wins[i].root);
+    else if (typed.len && winof(typed.from) == curwin)
+        fanout(root);
+    if (typed.cap > MINQUEUE){
+        free(typed.b);
+        typed.b = NULL;
+        typed.cap = 0;
     }
-
-    return true;
+    typed.len = 0;
+    typed.from = NULL;
 }
 
 static void
-scrollback(NODE *n)
+sendkeys(NODE *n, const char *s, size_t c) /* Send what was typed to n. */
 {
-    n->s->off = MAX(0, n->s->off - n->h / 2);
+    queue(n, s, c);
+    if (!broadcast)
+        return;
+    if (typed.from != n)
+        broadcastkeys();
+    if (typed.len + c > typed.cap && typed.len + c <= QUEUE_SIZE){
+        size_t cap = MAX(typed.len + c, MAX(typed.cap * 2, MINQUEUE));
+        char *b = realloc(typed.b, cap);
+        if (!b)
+            return;
+        typed.b = b;
+        typed.cap = cap;
+    }
+    if (typed.len + c <= typed.cap){
+        memcpy(typed.b + typed.len, s, c);
+        typed.len += c;
+        typed.from = n;
+    }
 }
 
 static void
-scrollforward(NODE *n)
+mark(NODE *n) /* Mark or unmark n to be broadcast to. */
 {
-    n->s->off = MIN(n->s->tos, n->s->off + n->h / 2);
+    n->marked = !n->marked;
+    nmarked += n->marked? 1 : -1;
 }
 
+static const char *keyseqs[KEY_MAX + 1] ={ /* what special keys send */
+    [KEY_HOME]  = "\033[1~",  [KEY_END]   = "\033[4~",  [KEY_PPAGE] = "\033[5~",
+    [KEY_NPAGE] = "\033[6~",  [KEY_DC]    = "\033[3~",  [KEY_IC]    = "\033[2~",
+    [KEY_BTAB]  = "\033[Z",   [KEY_BACKSPACE] = "\177",
+    [KEY_F(1)]  = "\033OP",   [KEY_F(2)]  = "\033OQ",   [KEY_F(3)]  = "\033OR",
+    [KEY_F(4)]  = "\033OS",   [KEY_F(5)]  = "\033[15~", [KEY_F(6)]  = "\033[17~",
+    [KEY_F(7)]  = "\033[18~", [KEY_F(8)]  = "\033[19~", [KEY_F(9)]  = "\033[20~",
+    [KEY_F(10)] = "\033[21~", [KEY_F(11)] = "\033[23~", [KEY_F(12)] = "\033[24~"
+};
+
 static void
-scrollbottom(NODE *n)
+sendchar(NODE *n, wchar_t k) /* Send a typed character to n. */
 {
-    n->s->off = n->s->tos;
+    char c[MB_LEN_MAX + 1] = {0};
+    int b = wctomb(c, k);
+    if (b > 0){
+        scrollbottom(n);
+        sendkeys(n, c, (size_t)b);
+    }
 }
 
 static void
-sendarrow(const NODE *n, const char *k)
+sendarrow(NODE *n, const char *k)
 {
     char buf[100] = {0};
     snprintf(buf, sizeof(buf) - 1, "\033%s%s", n->pnm? "O" : "[", k);
-    SEND(n, buf);
+    sendkeys(n, buf, strlen(buf));
+}
+
+static void
+endpaste(void) /* Finish the paste under way, if any. */
+{
+    if (paste.to && paste.marked)
+        sendkeys(paste.to, "\033[201~", 6);
+    paste.to = NULL;
+}
+
+static void
+startpaste(NODE *n) /* Pass what's pasted next straight on to n. */
+{
+    endpaste();
+    paste.to = n;
+    paste.marked = n->paste && search.n != n;
+    paste.last = now();
+    if (paste.marked)
+        sendkeys(n, "\033[200~", 6);
 }
 
 static bool
@@ -1047,45 +4041,55 @@ handlechar(int r, int k) /* Handle a single input character. */
     #define KERR(i) (r == ERR && (i) == k)
     #define KEY(i)  (r == OK  && (i) == k)
     #define CODE(i) (r == KEY_CODE_YES && (i) == k)
-    #define INSCR (n->s->tos != n->s->off)
+    #define INSCR (n->s->off != 0)
+    #define SEARCHING (search.n == n)
+    #define ENTER (KEY(L'\r') || KEY(L'\n') || CODE(KEY_ENTER))
+    #define ERASE (KEY(L'\b') || KEY(L'\177') || CODE(KEY_BACKSPACE))
     #define SB scrollbottom(n)
+    #define SENDKEYS(s) sendkeys(n, s, strlen(s))
     #define DO(s, t, a) \
         if (s == cmd && (t)) { a ; cmd = false; return true; }
 
+    if (CODE(KEY_RESIZE))
+        record(REC_SIZE, NULL, LINES, COLS, NULL, 0);
+    else if (r != ERR)
+        record(REC_KEY, NULL, r, k, NULL, 0);
+
+    if (paste.to && (paste.to != n || now() - paste.last > PASTE_MS / 1000.0))
+        endpaste(); /* its end was lost, or it went elsewhere */
+    else if (paste.to)
+        paste.last = now();
+    if (r == OK && !cmd && !SEARCHING && !INSCR && (paste.to || k >= L' '))
+        return sendchar(n, k), true; /* most keys, and pastes, go straight through */
+
     DO(cmd,   KERR(k),             return false)
-    DO(cmd,   CODE(KEY_RESIZE),    reshape(root, 0, 0, LINES, COLS); SB)
+    DO(cmd,   CODE(KEY_RESIZE),    reshape(root, 0, 0, layoutlines(), COLS); SB)
+    DO(cmd,   CODE(PASTE_START),   startpaste(n))
+    DO(cmd,   CODE(PASTE_END),     endpaste())
     DO(false, KEY(commandkey),     return cmd = true)
-    DO(false, KEY(0),              SENDN(n, "\000", 1); SB)
-    DO(false, KEY(L'\n'),          SEND(n, "\n"); SB)
-    DO(false, KEY(L'\r'),          SEND(n, n->lnm? "\r\n" : "\r"); SB)
+    DO(false, SEARCHING && KEY(27), endsearch(false))
+    DO(false, SEARCHING && ENTER,  endsearch(true))
+    DO(false, SEARCHING && ERASE,  editsearch(n, 0))
+    DO(false, SEARCHING && SEARCH_OLDER, stepsearch(n, -1))
+    DO(false, SEARCHING && SEARCH_NEWER, stepsearch(n, 1))
+    DO(false, SEARCHING && SEARCH_REGEX, search.regex ^= 1; refind(n))
+    DO(false, SEARCHING && SCROLLUP, scrollback(n))
+    DO(false, SEARCHING && SCROLLDOWN, scrollforward(n))
+    DO(false, SEARCHING && r == OK && iswprint(k), editsearch(n, k))
+    DO(false, SEARCHING,           (void)0) /* nothing else goes to the pty */
+    DO(false, KEY(0),              sendkeys(n, "\000", 1); SB)
+    DO(false, KEY(L'\n'),          SENDKEYS("\n"); SB)
+    DO(false, KEY(L'\r'),          SENDKEYS(n->lnm? "\r\n" : "\r"); SB)
     DO(false, SCROLLUP && INSCR,   scrollback(n))
     DO(false, SCROLLDOWN && INSCR, scrollforward(n))
     DO(false, RECENTER && INSCR,   scrollbottom(n))
-    DO(false, CODE(KEY_ENTER),     SEND(n, n->lnm? "\r\n" : "\r"); SB)
+    DO(false, CODE(KEY_ENTER),     SENDKEYS(n->lnm? "\r\n" : "\r"); SB)
     DO(false, CODE(KEY_UP),        sendarrow(n, "A"); SB);
     DO(false, CODE(KEY_DOWN),      sendarrow(n, "B"); SB);
     DO(false, CODE(KEY_RIGHT),     sendarrow(n, "C"); SB);
     DO(false, CODE(KEY_LEFT),      sendarrow(n, "D"); SB);
-    DO(false, CODE(KEY_HOME),      SEND(n, "\033[1~"); SB)
-    DO(false, CODE(KEY_END),       SEND(n, "\033[4~"); SB)
-    DO(false, CODE(KEY_PPAGE),     SEND(n, "\033[5~"); SB)
-    DO(false, CODE(KEY_NPAGE),     SEND(n, "\033[6~"); SB)
-    DO(false, CODE(KEY_BACKSPACE), SEND(n, "\177"); SB)
-    DO(false, CODE(KEY_DC),        SEND(n, "\033[3~"); SB)
-    DO(false, CODE(KEY_IC),        SEND(n, "\033[2~"); SB)
-    DO(false, CODE(KEY_BTAB),      SEND(n, "\033[Z"); SB)
-    DO(false, CODE(KEY_F(1)),      SEND(n, "\033OP"); SB)
-    DO(false, CODE(KEY_F(2)),      SEND(n, "\033OQ"); SB)
-    DO(false, CODE(KEY_F(3)),      SEND(n, "\033OR"); SB)
-    DO(false, CODE(KEY_F(4)),      SEND(n, "\033OS"); SB)
-    DO(false, CODE(KEY_F(5)),      SEND(n, "\033[15~"); SB)
-    DO(false, CODE(KEY_F(6)),      SEND(n, "\033[17~"); SB)
-    DO(false, CODE(KEY_F(7)),      SEND(n, "\033[18~"); SB)
-    DO(false, CODE(KEY_F(8)),      SEND(n, "\033[19~"); SB)
-    DO(false, CODE(KEY_F(9)),      SEND(n, "\033[20~"); SB)
-    DO(false, CODE(KEY_F(10)),     SEND(n, "\033[21~"); SB)
-    DO(false, CODE(KEY_F(11)),     SEND(n, "\033[23~"); SB)
-    DO(false, CODE(KEY_F(12)),     SEND(n, "\033[24~"); SB)
+    DO(false, r == KEY_CODE_YES && k > 0 && k <= KEY_MAX && keyseqs[k],
+              SENDKEYS(keyseqs[k]); SB)
     DO(true,  MOVE_UP,             focus(findnode(root, ABOVE(n))))
     DO(true,  MOVE_DOWN,           focus(findnode(root, BELOW(n))))
     DO(true,  MOVE_LEFT,           focus(findnode(root, LEFT(n))))
@@ -1094,71 +4098,558 @@ handlechar(int r, int k) /* Handle a single input character. */
     DO(true,  HSPLIT,              split(n, HORIZONTAL))
     DO(true,  VSPLIT,              split(n, VERTICAL))
     DO(true,  DELETE_NODE,         deletenode(n))
-    DO(true,  REDRAW,              touchwin(stdscr); draw(root); redrawwin(stdscr))
+    DO(true,  REDRAW,              relayout = true; clearok(curscr, TRUE))
+    DO(true,  session.listen >= 0 && DETACH, detach())
+    DO(true,  STATISTICS,          showstats ^= 1; repaint(root); relayout = true)
+    DO(true,  BROADCAST,           broadcastkeys(); broadcast ^= 1; repaint(root))
+    DO(true,  MARK,                mark(n); repaint(root))
+    DO(true,  NEW_WINDOW,          openwin())
+    DO(true,  NEXT_WINDOW,         showwin((curwin + 1) % nwins))
+    DO(true,  PREV_WINDOW,         showwin((curwin + nwins - 1) % nwins))
+    DO(true,  r == OK && k >= L'1' && k <= L'9', showwin(k - L'1'))
     DO(true,  SCROLLUP,            scrollback(n))
     DO(true,  SCROLLDOWN,          scrollforward(n))
     DO(true,  RECENTER,            scrollbottom(n))
-    DO(true,  KEY(commandkey),     SENDN(n, cmdstr, 1));
-    char c[MB_LEN_MAX + 1] = {0};
-    if (wctomb(c, k) > 0){
-        scrollbottom(n);
-        SEND(n, c);
-    }
+    DO(true,  SEARCH,              startsearch(n))
+    DO(true,  KEY(commandkey),     sendkeys(n, cmdstr, 1));
+    if (r == OK)
+        sendchar(n, k);
     return cmd = false, true;
 }
 
+/*** STATISTICS
+ * Every view counts the bytes it has read, the lines it has scrolled, the
+ * frames it has drawn and the time spent parsing and drawing it, and its
+ * parser counts events by type and callbacks by final character; mtm
+ * counts passes through its main loop and the time spent in doupdate().
+ * They can be shown over the screen, for the views of the current window,
+ * or written out for every view on SIGUSR1. Views are listed by their id,
+ * which stays the same while they're open, whatever else opens or closes.
+ */
+static volatile sig_atomic_t wantstats = 0;
+
+static void
+handleusr1(int sig) /* Someone wants the statistics written out. */
+{
+    (void)sig;
+    wantstats = 1;
+}
+
+static size_t
+footprint(const NODE *n) /* Estimate the memory n uses, besides spill files. */
+{
+    size_t cells = (size_t)(PADHEIGHT(n->h) + n->h + (n->hwin? n->h : 0)) * n->w;
+    return sizeof(NODE) + cells * sizeof(cchar_t) + n->hbytes
+         + n->hcap * sizeof(LINE *) + n->outcap + n->bcap * sizeof(BLOOM)
+         + n->ntabs * sizeof(bool);
+}
+
+static const char *
+human(double v, char *b) /* Format v with a K, M or G suffix into b. */
+{
+    const char *u = "KMG";
+    if (v < 1000.0)
+        return snprintf(b, 16, "%.0f", v), b;
+    for (v /= 1024.0; v >= 1000.0 && u[1]; u++)
+        v /= 1024.0;
+    snprintf(b, 16, "%.1f%c", v, *u);
+    return b;
+}
+
+static void
+statrows(NODE *n, WINDOW *w, int *row) /* Add a row for each view under n. */
+{
+    char a[16], b[16];
+    if (n->t != VIEW){
+        statrows(n->c1, w, row);
+        statrows(n->c2, w, row);
+        return;
+    }
+    mvwprintw(w, *row, 0, "%c%3d %4dx%-3d %7s %7.2f %6.2f %7lu %8lu %7s",
+              n == focused? '*' : ' ', n->id, n->w, n->h,
+              human((double)n->st.read, a), n->st.parse, n->st.draw,
+              n->st.frames, n->st.scrolls, human((double)footprint(n), b));
+    ++*row;
+}
+
+static int
+countviews(NODE *n) /* Count the views under n. */
+{
+    return n->t == VIEW? 1 : countviews(n->c1) + countviews(n->c2);
+}
+
+static void
+drawstats(void) /* Show the statistics of the current window's views. */
+{
+    char a[16];
+    int row = 1, rows = countviews(root) + 2, cols = MIN(COLS, 64);
+    WINDOW *w = newpad(rows, cols);
+    if (!w)
+        return;
+    wattrset(w, A_REVERSE);
+    wbkgdset(w, ' ' | A_REVERSE);
+    werase(w);
+    mvwaddstr(w, 0, 0, "view size       read   parse   draw  frames  scrolls  memory");
+    statrows(root, w, &row);
+    mvwprintw(w, row, 0, "loops %lu, doupdate %.2fs, scrollback %s", loops,
+              updatetime, human((double)histbytes, a));
+    pnoutrefresh(w, 0, 0, 0, 0, MIN(rows, LINES) - 1, cols - 1);
+    delwin(w);
+}
+
+static void
+dumpview(FILE *f, NODE *n, int win, int *i) /* Write out each view under n. */
+{
+    static const char *types[] = {"ctl", "esc", "csi"};
+    const VTSTATS *v = &n->vp.stats;
+    if (n->t != VIEW){
+        dumpview(f, n->c1, win, i);
+        dumpview(f, n->c2, win, i);
+        return;
+    }
+    fprintf(f, "view id=%d window=%d index=%d focused=%d y=%d x=%d h=%d w=%d"
+               " read=%lu parse=%.6f draw=%.6f frames=%lu scrolls=%lu"
+               " memory=%zu spilled=%zu control=%lu escape=%lu csi=%lu"
+               " osc=%lu print=%lu printn=%lu",
+            n->id, win + 1, ++*i, n == focused, n->y, n->x, n->h, n->w,
+            n->st.read, n->st.parse, n->st.draw, n->st.frames, n->st.scrolls,
+            footprint(n), n->spillsize, v->events[VTPARSER_CONTROL],
+            v->events[VTPARSER_ESCAPE], v->events[VTPARSER_CSI],
+            v->events[VTPARSER_OSC], v->events[VTPARSER_PRINT],
+            v->events[VTPARSER_PRINTN]);
+    for (int t = 0; t < VTPARSER_OSC; t++)
+        for (int c = 0; c < MAXCALLBACK; c++) if (v->calls[t][c])
+            fprintf(f, " %s.%02x=%lu", types[t], c, v->calls[t][c]);
+    fputc('\n', f);
+}
+
+static void
+dumpstats(void) /* Write the statistics out to a file, replacing it whole. */
+{
+    char dir[PATH_MAX - 32] = {0}, path[PATH_MAX] = {0}, tmp[PATH_MAX] = {0};
+    if (!userdir(dir, sizeof(dir)))
+        return;
+    snprintf(path, sizeof(path), "%s/%ld.stats", dir, (long)getpid());
+    snprintf(tmp, sizeof(tmp), "%s/.stats.XXXXXX", dir);
+    int fd = mkstemp(tmp);
+    FILE *f = fd >= 0? fdopen(fd, "w") : NULL;
+    if (!f){
+        if (fd >= 0)
+            close(fd), unlink(tmp);
+        return;
+    }
+
+    int views = 0;
+    for (int i = 0; i < nwins; i++)
+        views += countviews(i == curwin? root : wins[i].root);
+    fprintf(f, "mtm pid=%ld windows=%d views=%d loops=%lu doupdate=%.6f"
+               " scrollback=%zu\n", (long)getpid(), nwins, views, loops,
+            updatetime, histbytes);
+    for (int i = 0, k = 0; i < nwins; i++, k = 0)
+        dumpview(f, i == curwin? root : wins[i].root, i, &k);
+    if (fclose(f) == 0)
+        rename(tmp, path);
+    else
+        unlink(tmp);
+}
+
+static void
+flushhost(void) /* Send the host terminal what's queued for it. */
+{
+    int fd = session.listen >= 0? session.host : STDOUT_FILENO;
+    if (!headless && (session.listen < 0 || session.client >= 0)){
+        ssize_t w = 0;
+        for (size_t i = 0; i < tohost.len; i += (size_t)w)
+            if ((w = write(fd, tohost.b + i, tohost.len - i)) <= 0)
+                break;
+    }
+    if (tohost.cap > READ_SIZE){
+        free(tohost.b);
+        tohost.b = NULL;
+        tohost.cap = 0;
+    }
+    tohost.len = 0;
+}
+
+static bool
+render(void) /* Push changed views, and the cursor, to the terminal. */
+{
+    flushhost(); /* or drop it, with nobody looking */
+    if (session.listen >= 0 && (session.client < 0 || !session.sized))
+        return false; /* nobody's looking, or we don't know how yet */
+    if (retitled() || relayout){ /* the bottom row and separators rarely change */
+        werase(stdscr);
+        drawlines(root);
+        drawlist();
+        wnoutrefresh(stdscr);
+        relayout = false;
+    }
+    held = false;
+    draw(root);
+    if (showstats)
+        drawstats();
+    fixcursor();
+    double start = now();
+    doupdate();
+    updatetime += now() - start;
+    return held; /* flooding views need another look */
+}
+
+static int
+until(double t) /* Milliseconds until t, for use as a timeout. */
+{
+    double d = t - now();
+    return d <= 0.0? 0 : (int)(d * 1000.0) + 1;
+}
+
 static void
 run(void) /* Run MTM. */
 {
+    bool dirty = false, passing = false;
+    double lastframe = 0.0, lastkey = 0.0;
+    double frametime = framerate? 1.0 / framerate : 0.0;
     while (root){
         wint_t w = 0;
-        fd_set sfds = fds;
-        if (select(nfds + 1, &sfds, NULL, NULL, NULL) < 0)
-            FD_ZERO(&sfds);
+        int timeout = resume(now());
+        if (dirty && (timeout < 0 || until(lastframe + frametime) < timeout))
+            timeout = until(lastframe + frametime);
+        bool wait = backedup(focused); /* until it catches up, or stalls */
+        double stall = focused->drained + STALL_MS / 1000.0;
+        watchkeys(!wait);
+        if (wait && (timeout < 0 || until(stall) < timeout))
+            timeout = until(stall);
+        if (passing && !wait) /* curses has keys from a client to read */
+            timeout = 0;
+        if (showstats && (timeout < 0 || until(lastframe + STATS_MS / 1000.0) < timeout))
+            timeout = until(lastframe + STATS_MS / 1000.0); /* keep them current */
+        waitready(timeout);
+        passing = session.listen >= 0 && serve();
+        loops++;
+        if (wantstats){
+            wantstats = 0;
+            dumpstats();
+        }
 
-        int r = wget_wch(focused->s->win, &w);
-        while (handlechar(r, w))
+        int r = backedup(focused)? ERR : wget_wch(focused->s->win, &w);
+        bool gotkey = r != ERR, echo = false;
+        while (handlechar(r, w) && !backedup(focused))
             r = wget_wch(focused->s->win, &w);
-        getinput(root, &sfds);
+        broadcastkeys();
+        flushall(); /* what was typed goes out in one write */
+        lastkey = gotkey? now() : lastkey;
+
+        for (int i = 1; i < nready; i++) if (ready[i] == focused){
+            ready[i] = ready[0]; /* the focused view goes first */
+            ready[0] = focused;
+        }
+        double deadline = now() + LATENCY_MS / 1000.0;
+        for (int i = 0; i < nready; i++) if (ready[i]){
+            NODE *n = ready[i]; /* unread views stay ready for next time */
+            bool fg = n == focused;
+            ssize_t b = getinput(n, fg? FOCUSED_BUDGET : READ_BUDGET, deadline);
+            int win = b > 0? winof(n) : curwin;
+            if (b < 0){
+                record(REC_CLOSE, n, 0, 0, NULL, 0);
+                deletenode(n);
+            }
+            else if (!fg && b >= READ_BUDGET)
+                throttle(n);
+            if (win != curwin && !wins[win].active) /* shown in the window list */
+                wins[win].active = relayout = true;
+            echo |= fg && b > 0 && now() - lastkey < ECHO_MS / 1000.0;
+            dirty |= b != 0;
+        }
+        flushall();
 
-        draw(root);
-        doupdate();
-        fixcursor();
-        draw(focused);
-        doupdate();
+        if (gotkey || echo || relayout || (dirty && now() >= lastframe + frametime)
+                  || (showstats && now() >= lastframe + STATS_MS / 1000.0)){
+            dirty = render();
+            lastframe = now();
+        }
+    }
+}
+
+/*** BENCHMARKING
+ * With -B, mtm runs headless: the host terminal is /dev/null, views
+ * have no ptys, and the given file is fed to every view in read-sized
+ * chunks with a full render after each round, as run() would. If the
+ * file is a recording made with -L, it's replayed instead, as fast as
+ * possible, with a render after each read; -P replays one on the host
+ * terminal, as it was recorded.
+ */
+static NODE *
+largest(NODE *n) /* Find the largest view under n. */
+{
+    if (n->t == VIEW)
+        return n;
+    NODE *a = largest(n->c1), *b = largest(n->c2);
+    return a->h * a->w >= b->h * b->w? a : b;
+}
+
+static int
+views(NODE *n, NODE **v, int i) /* Collect the views under n into v. */
+{
+    if (n->t == VIEW)
+        return v[i] = n, i + 1;
+    return views(n->c2, v, views(n->c1, v, i));
+}
+
+static NODE *
+findview(NODE *n, int id) /* Find the view under n with the given id. */
+{
+    if (n->t == VIEW)
+        return n->id == id? n : NULL;
+    NODE *v = findview(n->c1, id);
+    return v? v : findview(n->c2, id);
+}
+
+static NODE *
+viewbyid(int id) /* Find the view with the given id in any window. */
+{
+    NODE *v = NULL;
+    for (int i = 0; !v && id >= 0 && i < nwins; i++)
+        v = findview(i == curwin? root : wins[i].root, id);
+    return v;
+}
+
+static bool
+stopped(double when) /* Wait for a key until then, drawing as we go. */
+{
+    struct pollfd k = {.fd = STDIN_FILENO, .events = POLLIN};
+    while (now() < when){
+        render();
+        if (poll(&k, 1, MIN(until(when), 1000 / MAX(framerate, 1))) > 0)
+            return true;
+    }
+    return false;
+}
+
+static bool
+replay(bool realtime, long baserss) /* Replay a recording; did it match? */
+{
+    RECORD r;
+    char *data = NULL;
+    size_t cap = 0;
+    unsigned long records = 0, frames = 0, bytes = 0, checks = 0, bad = 0;
+    bool stop = false;
+    double start = now();
+    while (!stop && fread(&r, sizeof(r), 1, playback) == 1){
+        if (r.len > cap){
+            char *d = realloc(data, r.len);
+            if (!d)
+                quit(EXIT_FAILURE, "out of memory");
+            data = d;
+            cap = r.len;
+        }
+        if (r.len && fread(data, 1, r.len, playback) != r.len)
+            break;
+        if (realtime && (stop = stopped(start + r.ns / 1e9)))
+            break;
+
+        NODE *n = viewbyid(r.view);
+        records++;
+        switch (r.t){
+            case REC_OUTPUT:
+                if (n){
+                    parse(n, data, r.len);
+                    n->st.read += r.len;
+                    bytes += r.len;
+                }
+                histbudget();
+                if (!realtime)
+                    render(), frames++;
+                break;
+
+            case REC_KEY:
+                handlechar(r.a, r.b);
+                broadcastkeys();
+                break;
+
+            case REC_SIZE:
+                resize_term(r.a, r.b);
+                handlechar(KEY_CODE_YES, KEY_RESIZE);
+                break;
+
+            case REC_CLOSE: /* the last view stays, to be checked */
+                if (n && (n->p || nwins > 1))
+                    deletenode(n);
+                break;
+
+            case REC_SCREEN:
+                checks++;
+                bad += screenhash() != ((uint64_t)(uint32_t)r.a << 32 | (uint32_t)r.b);
+                break;
+        }
+    }
+    double elapsed = now() - start;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    if (realtime && !stop)
+        stopped(now() + 1.0); /* let the last screen be seen */
+
+    endwin();
+    printf("records %lu (%lu bytes of output)\n", records, bytes);
+    if (!realtime){
+        printf("bytes/s %.0f\n", bytes / elapsed);
+        printf("frames %lu (%.1f/s)\n", frames, frames / elapsed);
+        printf("peak rss %ld KiB\n", ru.ru_maxrss - baserss);
+    }
+    printf("screens %s\n", stop? "not checked (stopped)" :
+                           !checks? "not checked (no hash recorded)" :
+                           bad? "differ" : "match");
+    free(data);
+    return !bad;
+}
+
+static void
+benchmark(const char *path, int npanes, long baserss) /* Replay a file. */
+{
+    size_t len = 0, cap = 0;
+    char *data = NULL;
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        quit(EXIT_FAILURE, "could not open benchmark file");
+    for (size_t r = 1; r; len += r){
+        if (len == cap && !(data = realloc(data, cap = cap * 2 + BUFSIZ)))
+            quit(EXIT_FAILURE, "out of memory");
+        r = fread(data + len, 1, cap - len, f);
     }
+    fclose(f);
+
+    for (int i = 1; i < npanes; i++){
+        NODE *n = largest(root);
+        int count = 0;
+        split(n, n->w > n->h * 3? HORIZONTAL : VERTICAL);
+        NODE **v = calloc(i + 1, sizeof(NODE *));
+        if (v)
+            count = views(root, v, 0);
+        free(v);
+        if (count <= i)
+            break; /* too small to split further */
+    }
+    NODE **v = calloc(npanes, sizeof(NODE *));
+    if (!v)
+        quit(EXIT_FAILURE, "out of memory");
+    npanes = views(root, v, 0);
+
+    unsigned long frames = 0, lines = 0;
+    for (size_t i = 0; i < len; i++)
+        lines += data[i] == '\n';
+
+    double start = now();
+    for (size_t o = 0; o < len; o += sizeof(iobuf)){
+        for (int i = 0; i < npanes; i++)
+            parse(v[i], data + o, MIN(sizeof(iobuf), len - o));
+        render();
+        frames++;
+    }
+    double elapsed = now() - start;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    endwin();
+    printf("panes %d (%dx%d screen)\n", npanes, LINES, COLS);
+    printf("bytes/s %.0f\n", (double)len * npanes / elapsed);
+    printf("lines/s %.0f\n", (double)lines * npanes / elapsed);
+    printf("frames %lu (%.1f/s)\n", frames, frames / elapsed);
+    printf("peak rss/pane %ld KiB\n", (ru.ru_maxrss - baserss) / npanes);
+    free(v);
+    free(data);
 }
 
 int
 main(int argc, char **argv)
 {
-    FD_SET(STDIN_FILENO, &fds);
     setlocale(LC_ALL, "");
+    if (!spilldir)
+        spilldir = getenv("XDG_RUNTIME_DIR");
+    setupevents();
     signal(SIGCHLD, SIG_IGN); /* automatically reap children */
+    struct sigaction usr1 = {.sa_handler = handleusr1}; /* interrupts waiting */
+    sigaction(SIGUSR1, &usr1, NULL);
 
-    int c = 0;
-    while ((c = getopt(argc, argv, "c:T:t:")) != -1) switch (c){
+    int c = 0, npanes = 1;
+    const char *bench = NULL, *name = NULL, *log = NULL, *play = NULL;
+    while ((c = getopt(argc, argv, "c:T:t:r:s:a:L:P:B:N:")) != -1) switch (c){
         case 'c': commandkey = CTL(optarg[0]);      break;
+        case 'r': framerate = MAX(atoi(optarg), 0);  break;
+        case 's': histmax = MAX(atoi(optarg), 0);    break;
         case 'T': setenv("TERM", optarg, 1);        break;
         case 't': term = optarg;                    break;
+        case 'a': name = optarg;                    break;
+        case 'L': log = optarg;                     break;
+        case 'P': play = optarg;                    break;
+        case 'B': bench = optarg;                   break;
+        case 'N': npanes = MAX(atoi(optarg), 1);    break;
         default:  quit(EXIT_FAILURE, USAGE);        break;
     }
 
-    if (!initscr())
+    HEADER h;
+    memset(&h, 0, sizeof(h));
+    const char *recording = play? play : bench;
+    if (recording && (playback = fopen(recording, "rb"))
+                  && (fread(&h, sizeof(h), 1, playback) != 1
+                      || memcmp(h.magic, RECORD_MAGIC, sizeof(h.magic)))){
+        fclose(playback); /* not a recording; just bytes to benchmark with */
+        playback = NULL;
+    }
+    if (play && !playback)
+        quit(EXIT_FAILURE, "could not open recording");
+    if (playback){ /* keys mean what they did, and colors map the same */
+        commandkey = h.commandkey;
+        h.term[sizeof(h.term) - 1] = 0;
+        if (bench && *h.term)
+            setenv("TERM", h.term, 1);
+    }
+
+    if (name && !bench && !play)
+        opensession(name); /* only a new server returns */
+    if (!initpoll())
+        quit(EXIT_FAILURE, "could not initialize event loop");
+    if (bench){
+        FILE *null = fopen("/dev/null", "r+");
+        const char *host = getenv("TERM")? getenv("TERM") : "xterm-256color";
+        headless = true;
+        if (!null || !newterm(host, null, null))
+            quit(EXIT_FAILURE, "could not initialize terminal");
+    } else if (session.listen >= 0 && !startserver())
+        quit(EXIT_FAILURE, "could not initialize terminal");
+    else if (session.listen < 0 && !initscr())
         quit(EXIT_FAILURE, "could not initialize terminal");
+    if (!headless && !watch(NULL, keyfd))
+        quit(EXIT_FAILURE, "could not initialize event loop");
     raw();
+    if (!headless){ /* have the host mark pastes, so they can be passed on whole */
+        define_key("\033[200~", PASTE_START);
+        define_key("\033[201~", PASTE_END);
+        hostpaste = session.listen < 0 /* clients do this themselves */
+                 && putp("\033[?2004h") == OK && fflush(stdout) == 0;
+    }
     noecho();
     nonl();
     intrflush(stdscr, FALSE);
     start_color();
     use_default_colors();
+    fitcolors();
+
+    if (playback)
+        resize_term(h.rows, h.cols);
 
-    root = newview(NULL, 0, 0, LINES, COLS);
-    if (!root)
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    wins = calloc(1, sizeof(WIN));
+    root = newview(NULL, 0, 0, layoutlines(), COLS);
+    if (!wins || !root)
         quit(EXIT_FAILURE, "could not open root window");
     focus(root);
-    draw(root);
-    run();
+    if (playback)
+        quit(replay(!bench, ru.ru_maxrss)? EXIT_SUCCESS : EXIT_FAILURE, NULL);
+    else if (bench)
+        benchmark(bench, npanes, ru.ru_maxrss);
+    else if (log && !startrecording(log))
+        quit(EXIT_FAILURE, "could not start recording");
+    else
+        run();
 
     quit(EXIT_SUCCESS, NULL);
     return EXIT_SUCCESS; /* not reached */
@@ -0,0 +1,328 @@
+/* vtbench - measure how fast vtparser gets through streams of pty output.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <langinfo.h>
+#include <locale.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vtparser.h"
+
+#define MIN(x, y) ((x) < (y)? (x) : (y))
+#define USAGE "usage: vtbench [-c CHUNK] [-s MB] [-t SECS] [FILE...]\n"
+
+/*** DATA TYPES */
+typedef struct CORPUS CORPUS;
+struct CORPUS{
+    const char *name;
+    char *b;
+    size_t n, cap;
+};
+
+/*** GLOBALS */
+static unsigned long events;
+static unsigned long rng = 1;
+static size_t chunk = BUFSIZ, target = 8 << 20;
+static double mintime = 0.5;
+
+/*** CALLBACKS
+ * The null callbacks measure the parser alone; the counting callbacks
+ * add the minimum work a real consumer does per event.
+ */
+static void
+null(VTPARSER *v, void *p, wchar_t w, wchar_t iw,
+     int argc, int *argv, const wchar_t *osc)
+{
+    (void)v; (void)p; (void)w; (void)iw; (void)argc; (void)argv; (void)osc;
+}
+
+static void
+count(VTPARSER *v, void *p, wchar_t w, wchar_t iw,
+      int argc, int *argv, const wchar_t *osc)
+{
+    (void)v; (void)p; (void)w; (void)iw; (void)argc; (void)argv; (void)osc;
+    events++;
+}
+
+static void
+countn(VTPARSER *v, void *p, wchar_t w, wchar_t iw,
+       int argc, int *argv, const wchar_t *osc)
+{
+    (void)v; (void)p; (void)w; (void)iw; (void)argv; (void)osc;
+    events += (unsigned long)argc;
+}
+
+static void
+setup(VTCALLBACKS *c, VTCALLBACK cb, VTCALLBACK cbn)
+{
+    for (wchar_t w = 0; w < MAXCALLBACK; w++){
+        vtonevent(c, VTPARSER_CONTROL, w, cb);
+        vtonevent(c, VTPARSER_ESCAPE,  w, cb);
+        vtonevent(c, VTPARSER_CSI,     w, cb);
+    }
+    vtonevent(c, VTPARSER_PRINT,  0, cb);
+    vtonevent(c, VTPARSER_PRINTN, 0, cbn);
+    vtonevent(c, VTPARSER_OSC,    0, cb);
+}
+
+/*** CORPUS GENERATION
+ * Synthetic stand-ins for captured pty streams, generated from a fixed
+ * seed so runs are comparable. Real captures (e.g. from script(1)) can
+ * be given on the command line as well.
+ */
+static unsigned long
+rnd(unsigned long n)
+{
+    rng = rng * 6364136223846793005UL + 1442695040888963407UL;
+    return (rng >> 33) % n;
+}
+
+static void
+put(CORPUS *c, const char *s, size_t n)
+{
+    if (c->n + n > c->cap){
+        c->cap = (c->n + n) * 2;
+        c->b = realloc(c->b, c->cap);
+        if (!c->b)
+            perror("realloc"), exit(EXIT_FAILURE);
+    }
+    memcpy(c->b + c->n, s, n);
+    c->n += n;
+}
+
+static void
+putf(CORPUS *c, const char *f, ...)
+{
+    char buf[4096];
+    va_list ap;
+    va_start(ap, f);
+    int n = vsnprintf(buf, sizeof(buf), f, ap);
+    va_end(ap);
+    put(c, buf, n < 0? 0 : MIN((size_t)n, sizeof(buf) - 1));
+}
+
+static const char *words[] ={
+    "request", "worker", "took", "cache", "miss", "upstream", "id", "ok",
+    "retry", "handler", "GET", "/api/v1/items", "200", "latency", "bytes"
+};
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+static void
+asciilog(CORPUS *c)
+{
+    for (unsigned long i = 0; c->n < target; i++){
+        putf(c, "2019-10-29 12:%02lu:%02lu.%03lu INFO [worker-%lu]",
+             i / 60 % 60, i % 60, rnd(1000), rnd(16));
+        for (unsigned long j = rnd(12) + 2; j; j--)
+            putf(c, " %s", words[rnd(NWORDS)]);
+        put(c, "\r\n", 2);
+    }
+}
+
+static void
+cjk(CORPUS *c)
+{
+    static const char *text[] ={
+        "日本語の", "テキスト", "中文字符", "한국어 ", "混在した", "ｶﾀｶﾅ",
+        "émigré ", "naïve ", "€100 ", "𝄞 ", "ok "
+    };
+    while (c->n < target){
+        for (unsigned long j = rnd(20) + 4; j; j--){
+            const char *t = text[rnd(sizeof(text) / sizeof(text[0]))];
+            put(c, t, strlen(t));
+        }
+        put(c, "\r\n", 2);
+    }
+}
+
+static void
+sgrlog(CORPUS *c)
+{
+    static const char *levels[] ={
+        "\033[32mINFO\033[0m", "\033[33;1mWARN\033[0m",
+        "\033[31;1mERROR\033[0m", "\033[38;5;244mDEBUG\033[0m"
+    };
+    while (c->n < target){
+        putf(c, "\033[2m%02lu:%02lu\033[22m %s ", rnd(24), rnd(60),
+             levels[rnd(4)]);
+        for (unsigned long j = rnd(8) + 2; j; j--)
+            putf(c, "\033[38;5;%lum%s\033[39m ", rnd(256), words[rnd(NWORDS)]);
+        put(c, "\033[m\r\n", 5);
+    }
+}
+
+static void
+redraw(CORPUS *c)
+{
+    while (c->n < target){ /* an editor repainting a 50x200 screen */
+        put(c, "\033[?25l\033[H", 9);
+        for (int y = 1; y <= 50; y++){
+            putf(c, "\033[%d;1H\033[33m%4d \033[m", y, y);
+            for (unsigned long j = rnd(20); j; j--)
+                putf(c, "%s\033[1;34m%s\033[m ", words[rnd(NWORDS)],
+                     words[rnd(NWORDS)]);
+            put(c, "\033[K", 3);
+        }
+        putf(c, "\033[50;1H\033[7m%-60s\033[m\033[%lu;%luH\033[?25h",
+             "-- INSERT --", rnd(50) + 1, rnd(200) + 1);
+    }
+}
+
+static void
+monitor(CORPUS *c)
+{
+    while (c->n < target){ /* a process monitor's periodic update */
+        put(c, "\033[H", 3);
+        for (int cpu = 0; cpu < 8; cpu++){
+            unsigned long u = rnd(40);
+            putf(c, "\033[%d;1H\033[36m%3d\033[m[\033[32m%.*s\033[31m%.*s"
+                 "\033[m%*s%4.1f%%]", cpu + 1, cpu, (int)u,
+                 "||||||||||||||||||||||||||||||||||||||||", (int)(u / 4),
+                 "||||||||||", (int)(40 - u - u / 4), "", u * 2.5);
+        }
+        for (int y = 10; y < 50; y++)
+            putf(c, "\033[%d;1H%6lu root      20   0 %7luM %6luK S %4.1f  0.%lu "
+                 "%2lu:%02lu.%02lu \033[1m%s\033[m\033[K", y, rnd(99999),
+                 rnd(9999), rnd(99999), rnd(1000) / 10.0, rnd(10), rnd(60),
+                 rnd(60), rnd(100), words[rnd(NWORDS)]);
+    }
+}
+
+static void
+osc(CORPUS *c)
+{
+    static const char b64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    while (c->n < target){
+        putf(c, "\033]0;%s@host: ~/src/%s\007$ ls\r\n", words[rnd(NWORDS)],
+             words[rnd(NWORDS)]);
+        put(c, "\033]52;c;", 7); /* a clipboard blob */
+        for (unsigned long j = rnd(65536) + 1024; j; j--)
+            put(c, &b64[rnd(64)], 1);
+        put(c, "\007", 1);
+    }
+}
+
+static void
+hugecsi(CORPUS *c)
+{
+    while (c->n < target){
+        put(c, "\033[", 2);
+        for (unsigned long j = rnd(2000) + 16; j; j--)
+            putf(c, "%lu%lu;", rnd(1000000000), rnd(1000000000));
+        put(c, "m\033[", 3);
+        for (unsigned long j = rnd(4096); j; j--)
+            put(c, "9", 1);
+        putf(c, "H\033[1:2:3:4:5:6m\033[!!!!!!!!!!!!p");
+        putf(c, "%s\r\n", words[rnd(NWORDS)]);
+    }
+}
+
+static void
+readfile(CORPUS *c, const char *path)
+{
+    char buf[65536];
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        perror(path), exit(EXIT_FAILURE);
+    for (size_t r; (r = fread(buf, 1, sizeof(buf), f)) > 0; )
+        put(c, buf, r);
+    fclose(f);
+}
+
+/*** BENCHMARK */
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench(const CORPUS *c, const char *mode, const VTCALLBACKS *cb)
+{
+    VTPARSER vp;
+    unsigned long passes = 0;
+    double start = now(), elapsed = 0.0;
+
+    vtinit(&vp, cb, NULL);
+    events = 0;
+    do{
+        for (size_t i = 0; i < c->n; i += chunk)
+            vtwrite(&vp, c->b + i, MIN(chunk, c->n - i));
+        passes++;
+    } while ((elapsed = now() - start) < mintime);
+
+    double bytes = (double)c->n * passes;
+    printf("%-14s %-6s %10.1f %10.2f %14.0f\n", c->name, mode,
+           bytes / elapsed / 1e6, elapsed * 1e9 / bytes, events / elapsed);
+}
+
+int
+main(int argc, char **argv)
+{
+    static VTCALLBACKS nullcb, countcb;
+    CORPUS corpora[] ={
+        {"ascii-log", NULL, 0, 0}, {"utf8-cjk", NULL, 0, 0},
+        {"sgr-log", NULL, 0, 0}, {"editor-redraw", NULL, 0, 0},
+        {"monitor", NULL, 0, 0}, {"long-osc", NULL, 0, 0},
+        {"huge-csi", NULL, 0, 0}
+    };
+    void (*gen[])(CORPUS *) ={asciilog, cjk, sgrlog, redraw, monitor, osc, hugecsi};
+    size_t ncorpora = sizeof(corpora) / sizeof(corpora[0]);
+
+    int c = 0;
+    while ((c = getopt(argc, argv, "c:s:t:")) != -1) switch (c){
+        case 'c': chunk = (size_t)atol(optarg);           break;
+        case 's': target = (size_t)atol(optarg) << 20;    break;
+        case 't': mintime = atof(optarg);                 break;
+        default:  fputs(USAGE, stderr); return EXIT_FAILURE;
+    }
+    if (!chunk || !target)
+        return fputs(USAGE, stderr), EXIT_FAILURE;
+
+    setlocale(LC_ALL, "");
+    if (strcmp(nl_langinfo(CODESET), "UTF-8") != 0)
+        setlocale(LC_ALL, "C.UTF-8");
+
+    setup(&nullcb, null, null);
+    setup(&countcb, count, countn);
+
+    printf("# codeset %s, %zu-byte writes\n", nl_langinfo(CODESET), chunk);
+    printf("%-14s %-6s %10s %10s %14s\n", "corpus", "mode", "MB/s",
+           "ns/byte", "events/s");
+    for (int i = optind; i < argc + (int)ncorpora; i++){
+        CORPUS f = {NULL, NULL, 0, 0}, *p = &f;
+        if (i < argc){
+            f.name = strrchr(argv[i], '/')? strrchr(argv[i], '/') + 1 : argv[i];
+            readfile(&f, argv[i]);
+        } else{
+            p = &corpora[i - argc];
+            gen[i - argc](p);
+        }
+        if (p->n){
+            bench(p, "null", &nullcb);
+            bench(p, "count", &countcb);
+        }
+        free(p->b);
+    }
+
+    return EXIT_SUCCESS;
+}
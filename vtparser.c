@@ -24,12 +24,20 @@
  * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
+#include <langinfo.h>
 #include <stdbool.h>
 #include <string.h>
 #include "vtparser.h"
 
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
 /**** DATA TYPES */
 #define MAXACTIONS  128
+#define MIN(x, y) ((x) < (y)? (x) : (y))
 
 typedef struct ACTION ACTION;
 struct ACTION{
@@ -38,22 +46,40 @@ struct ACTION{
     STATE *next;
 };
 
+typedef struct TRANSITION TRANSITION;
+struct TRANSITION{
+    void (*cb)(VTPARSER *p, wchar_t w);
+    const STATE *next;
+};
+
+/* Each state is declared as a prioritized list of actions, which is
+ * compiled once into a table indexed directly by character. The last
+ * table entry covers every character at or above MAXCALLBACK; no action
+ * range has a boundary up there, so one entry is enough.
+ */
 struct STATE{
     void (*entry)(VTPARSER *v);
+    void (*exit)(VTPARSER *v, wchar_t w); /* w is what caused the exit */
     ACTION actions[MAXACTIONS];
+    TRANSITION table[MAXCALLBACK + 1];
 };
 
 /**** GLOBALS */
 static STATE ground, escape, escape_intermediate, csi_entry,
              csi_ignore, csi_param, csi_intermediate, osc_string;
+static STATE *states[] ={
+    &ground, &escape, &escape_intermediate, &csi_entry,
+    &csi_ignore, &csi_param, &csi_intermediate, &osc_string
+};
+static const VTCALLBACKS nocallbacks;
 
 /**** ACTION FUNCTIONS */
 static void
-reset(VTPARSER *v)
+reset(VTPARSER *v) /* parameters are zeroed as they're collected */
 {
     v->inter = v->narg = v->nosc = 0;
-    memset(v->args, 0, sizeof(v->args));
-    memset(v->oscbuf, 0, sizeof(v->oscbuf));
+    v->subs = 0;
+    v->oscbuf[0] = 0;
 }
 
 static void
@@ -68,93 +94,287 @@ collect(VTPARSER *v, wchar_t w)
     v->inter = v->inter? v->inter : (int)w;
 }
 
+static void
+introduce(VTPARSER *v, wchar_t w)
+{
+    v->str = w;
+}
+
+static void
+flushosc(VTPARSER *v) /* Pass on what's been collected of a string. */
+{
+    if (v->nosc && v->cb->osc)
+        v->cb->osc(v, v->p, v->str, VTPARSER_STRING_DATA, v->nosc, NULL, v->oscbuf);
+    v->nosc = 0;
+    v->oscbuf[0] = 0;
+}
+
 static void
 collectosc(VTPARSER *v, wchar_t w)
 {
-    if (v->nosc < MAXOSC)
-        v->oscbuf[v->nosc++] = w;
+    if (v->nosc == MAXOSC)
+        flushosc(v);
+    v->oscbuf[v->nosc++] = w;
+    v->oscbuf[v->nosc] = 0;
 }
 
 static void
-param(VTPARSER *v, wchar_t w)
+startosc(VTPARSER *v)
 {
-    v->narg = v->narg? v->narg : 1;
+    reset(v);
+    v->stats.events[VTPARSER_OSC]++;
+    if (v->cb->osc)
+        v->cb->osc(v, v->p, v->str, VTPARSER_STRING_START, 0, NULL, NULL);
+}
 
-    if (w == L';')
+static void
+endosc(VTPARSER *v, wchar_t w) /* BEL or ESC (as in ST) end a string */
+{
+    flushosc(v);
+    if (v->cb->osc)
+        v->cb->osc(v, v->p, v->str, VTPARSER_STRING_END, w == 0x07 || w == 0x1b,
+                   NULL, NULL);
+}
+
+static void
+param(VTPARSER *v, wchar_t w) /* colons separate sub-parameters (T.416) */
+{
+    if (!v->narg)
         v->args[v->narg++] = 0;
-    else if (v->narg < MAXPARAM && v->args[v->narg - 1] < 9999)
-        v->args[v->narg - 1] = v->args[v->narg - 1] * 10 + (w - 0x30);
+
+    int *a = &v->args[v->narg - 1];
+    if ((w == L';' || w == L':') && v->narg < MAXPARAM){
+        v->subs |= (unsigned)(w == L':') << v->narg;
+        v->args[v->narg++] = 0;
+    } else if (w != L';' && w != L':' && *a < 9999)
+        *a = *a * 10 + (w - 0x30);
 }
 
-#define DO(k, t, f, n, a)                               \
+#define DO(k, e, t, f, n, a)                            \
     static void                                         \
     do ## k (VTPARSER *v, wchar_t w)                    \
     {                                                   \
-        if (t)                                          \
+        v->stats.events[e]++;                           \
+        if (t){                                         \
+            if (e < VTPARSER_OSC)                       \
+                v->stats.calls[e % VTPARSER_OSC][w]++;  \
             f (v, v->p, w, v->inter, n, a, v->oscbuf);  \
+        }                                               \
     }
 
-DO(control, w < MAXCALLBACK && v->cons[w], v->cons[w], 0, NULL)
-DO(escape,  w < MAXCALLBACK && v->escs[w], v->escs[w], v->inter > 0, &v->inter)
-DO(csi,     w < MAXCALLBACK && v->csis[w], v->csis[w], v->narg, v->args)
-DO(print,   v->print, v->print, 0, NULL)
-DO(osc,     v->osc, v->osc, v->nosc, NULL)
+DO(control, VTPARSER_CONTROL, w < MAXCALLBACK && v->cb->cons[w], v->cb->cons[w], 0, NULL)
+DO(escape,  VTPARSER_ESCAPE, w < MAXCALLBACK && v->cb->escs[w], v->cb->escs[w],
+            v->inter > 0, &v->inter)
+DO(csi,     VTPARSER_CSI, w < MAXCALLBACK && v->cb->csis[w] && (!v->subs || w == L'm'),
+            v->cb->csis[w], v->narg, v->args) /* only SGR takes sub-parameters */
+DO(print,   VTPARSER_PRINT, v->cb->print, v->cb->print, 0, NULL)
 
 /**** PUBLIC FUNCTIONS */
 VTCALLBACK
-vtonevent(VTPARSER *vp, VtEvent t, wchar_t w, VTCALLBACK cb)
+vtonevent(VTCALLBACKS *vc, VtEvent t, wchar_t w, VTCALLBACK cb)
 {
     VTCALLBACK o = NULL;
     if (w < MAXCALLBACK) switch (t){
-        case VTPARSER_CONTROL: o = vp->cons[w]; vp->cons[w] = cb; break;
-        case VTPARSER_ESCAPE:  o = vp->escs[w]; vp->escs[w] = cb; break;
-        case VTPARSER_CSI:     o = vp->csis[w]; vp->csis[w] = cb; break;
-        case VTPARSER_PRINT:   o = vp->print;   vp->print   = cb; break;
-        case VTPARSER_OSC:     o = vp->osc;     vp->osc     = cb; break;
+        case VTPARSER_CONTROL: o = vc->cons[w]; vc->cons[w] = cb; break;
+        case VTPARSER_ESCAPE:  o = vc->escs[w]; vc->escs[w] = cb; break;
+        case VTPARSER_CSI:     o = vc->csis[w]; vc->csis[w] = cb; break;
+        case VTPARSER_PRINT:   o = vc->print;   vc->print   = cb; break;
+        case VTPARSER_PRINTN:  o = vc->printn;  vc->printn  = cb; break;
+        case VTPARSER_OSC:     o = vc->osc;     vc->osc     = cb; break;
     }
 
     return o;
 }
 
+static void
+compile(STATE *s) /* Build the dispatch table for a state. */
+{
+    for (wchar_t w = 0; w <= MAXCALLBACK; w++){
+        TRANSITION *t = &s->table[w];
+        t->cb = ignore;
+        t->next = NULL;
+        for (const ACTION *a = s->actions; a->cb; a++) if (w >= a->lo && w <= a->hi){
+            t->cb = a->cb;
+            t->next = a->next;
+            break;
+        }
+    }
+}
+
+void
+vtinit(VTPARSER *vp, const VTCALLBACKS *vc, void *p)
+{
+    static bool compiled = false;
+    if (!compiled) for (size_t i = 0; i < sizeof(states) / sizeof(states[0]); i++)
+        compile(states[i]);
+    compiled = true;
+
+    memset(vp, 0, sizeof(*vp));
+    #ifdef __STDC_ISO_10646__
+    vp->utf8 = strcmp(nl_langinfo(CODESET), "UTF-8") == 0;
+    #endif
+    vp->s = &ground;
+    vp->cb = vc? vc : &nocallbacks;
+    vp->p = p;
+}
+
 static void
 handlechar(VTPARSER *vp, wchar_t w)
 {
-    vp->s = vp->s? vp->s : &ground;
-    for (ACTION *a = vp->s->actions; a->cb; a++) if (w >= a->lo && w <= a->hi){
-        a->cb(vp, w);
-        if (a->next){
-            vp->s = a->next;
-            if (a->next->entry)
-                a->next->entry(vp);
+    const TRANSITION *t = &vp->s->table[w < MAXCALLBACK? w : MAXCALLBACK];
+    t->cb(vp, w);
+    if (t->next){
+        if (vp->s->exit)
+            vp->s->exit(vp, w);
+        vp->s = t->next;
+        if (t->next->entry)
+            t->next->entry(vp);
+    }
+}
+
+static void
+printn(VTPARSER *vp, const wchar_t *r, size_t *n) /* Flush a printable run. */
+{
+    if (*n){
+        vp->stats.events[VTPARSER_PRINT] += *n;
+        vp->stats.events[VTPARSER_PRINTN]++;
+        vp->cb->printn(vp, vp->p, r[0], 0, (int)*n, NULL, r);
+    }
+    *n = 0;
+}
+
+static size_t
+asciispan(const unsigned char *s, size_t n) /* Count leading printable ASCII. */
+{
+    /* The signed compare against 0x20 catches both C0 controls and bytes
+     * with the high bit set, so one test finds the end of the span. */
+    size_t i = 0;
+    #if defined(__AVX2__)
+    const __m256i sp = _mm256_set1_epi8(0x20), del = _mm256_set1_epi8(0x7f);
+    for (; i + 32 <= n; i += 32){
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s + i));
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(
+                         _mm256_cmpgt_epi8(sp, b), _mm256_cmpeq_epi8(b, del)));
+        if (m)
+            return i + (size_t)__builtin_ctz(m);
+    }
+    #elif defined(__SSE2__)
+    const __m128i sp = _mm_set1_epi8(0x20), del = _mm_set1_epi8(0x7f);
+    for (; i + 16 <= n; i += 16){
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + i));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_or_si128(
+                         _mm_cmpgt_epi8(sp, b), _mm_cmpeq_epi8(b, del)));
+        if (m)
+            return i + (size_t)__builtin_ctz(m);
+    }
+    #endif
+    while (i < n && s[i] >= 0x20 && s[i] < 0x7f)
+        i++;
+    return i;
+}
+
+static bool
+decode(VTPARSER *vp, const unsigned char **s, const unsigned char *e,
+       wchar_t *w) /* Decode one UTF-8 character, false if s runs out. */
+{
+    while (*s < e){
+        unsigned char c = *(*s)++;
+        if (!vp->u8need){
+            if (c < 0x80){
+                *w = c;
+                return true;
+            } else if (c >= 0xc2 && c <= 0xdf){
+                vp->u8cp = c & 0x1f; vp->u8need = 1; vp->u8min = 0x80;
+            } else if (c >= 0xe0 && c <= 0xef){
+                vp->u8cp = c & 0x0f; vp->u8need = 2; vp->u8min = 0x800;
+            } else if (c >= 0xf0 && c <= 0xf4){
+                vp->u8cp = c & 0x07; vp->u8need = 3; vp->u8min = 0x10000;
+            } else{
+                *w = VTPARSER_BAD_CHAR;
+                return true;
+            }
+        } else if ((c & 0xc0) != 0x80){ /* truncated, reread c on its own */
+            vp->u8need = 0;
+            (*s)--;
+            *w = VTPARSER_BAD_CHAR;
+            return true;
+        } else{
+            vp->u8cp = (vp->u8cp << 6) | (c & 0x3f);
+            if (!--vp->u8need){
+                *w = vp->u8cp;
+                if (*w < vp->u8min || *w > 0x10ffff || (*w >= 0xd800 && *w <= 0xdfff))
+                    *w = VTPARSER_BAD_CHAR;
+                return true;
+            }
         }
-        return;
     }
+    return false;
 }
 
 void
 vtwrite(VTPARSER *vp, const char *s, size_t n)
 {
-    wchar_t w = 0;
-    while (n){
-        size_t r = mbrtowc(&w, s, n, &vp->ms);
-        switch (r){
-            case -2: /* incomplete character, try again */
-                return;
+    const unsigned char *u = (const unsigned char *)s, *e = u + n;
+    wchar_t w = 0, run[MAXPRINT];
+    size_t nrun = 0;
+    while (u < e){
+        if (vp->utf8 && !vp->u8need && vp->cb->printn && vp->s == &ground){
+            size_t k = asciispan(u, MIN((size_t)(e - u), MAXPRINT - nrun));
+            for (size_t i = 0; i < k; i++)
+                run[nrun + i] = u[i];
+            u += k;
+            nrun += k;
+            if (nrun == MAXPRINT)
+                printn(vp, run, &nrun);
+            if (k)
+                continue;
+        }
 
-            case -1: /* invalid character, skip it */
-                w = VTPARSER_BAD_CHAR;
-                r = 1;
-                break;
+        if (vp->utf8 && !vp->u8need && vp->s == &osc_string){ /* e.g. base64 */
+            if (vp->nosc == MAXOSC)
+                flushosc(vp);
+            size_t k = asciispan(u, MIN((size_t)(e - u), (size_t)(MAXOSC - vp->nosc)));
+            for (size_t i = 0; i < k; i++)
+                vp->oscbuf[vp->nosc + i] = u[i];
+            u += k;
+            vp->nosc += (int)k;
+            vp->oscbuf[vp->nosc] = 0;
+            if (k)
+                continue;
+        }
 
-            case 0: /* literal zero, write it but advance */
-                r = 1;
+        if (vp->utf8){
+            if (!decode(vp, &u, e, &w))
                 break;
+        } else{
+            size_t r = mbrtowc(&w, (const char *)u, (size_t)(e - u), &vp->ms);
+            switch (r){
+                case -2: /* incomplete character, try again */
+                    u = e;
+                    continue;
+
+                case -1: /* invalid character, skip it */
+                    w = VTPARSER_BAD_CHAR;
+                    r = 1;
+                    break;
+
+                case 0: /* literal zero, write it but advance */
+                    r = 1;
+                    break;
+            }
+            u += r;
         }
 
-        n -= r;
-        s += r;
-        handlechar(vp, w);
+        if (vp->cb->printn && vp->s->table[w < MAXCALLBACK? w : MAXCALLBACK].cb == doprint){
+            run[nrun++] = w;
+            if (nrun == MAXPRINT)
+                printn(vp, run, &nrun);
+        } else{
+            printn(vp, run, &nrun);
+            handlechar(vp, w);
+        }
     }
+    printn(vp, run, &nrun);
 }
 
 /**** STATE DEFINITIONS
@@ -162,9 +382,10 @@ vtwrite(VTPARSER *vp, const char *s, size_t n)
  * Paul Flo Williams: http://vt100.net/emu/dec_ansi_parser
  * Please note that Williams does not (AFAIK) endorse this work.
  */
-#define MAKESTATE(name, onentry, ...)         \
+#define MAKESTATE(name, onentry, onexit, ...) \
     static STATE name ={                      \
         onentry ,                             \
+        onexit ,                              \
         {                                     \
             {0x00, 0x00, ignore,    NULL},    \
             {0x7f, 0x7f, ignore,    NULL},    \
@@ -178,65 +399,65 @@ vtwrite(VTPARSER *vp, const char *s, size_t n)
             __VA_ARGS__ ,                     \
             {0x07, 0x07, docontrol, NULL},    \
             {0x00, 0x00, NULL,      NULL}     \
-        }                                     \
+        },                                    \
+        {{NULL, NULL}} /* see compile() */    \
     }
 
-MAKESTATE(ground, NULL,
+MAKESTATE(ground, NULL, NULL,
     {0x20, WCHAR_MAX, doprint, NULL}
 );
 
-MAKESTATE(escape, reset,
-    {0x21, 0x21, ignore,   &osc_string},
-    {0x20, 0x2f, collect,  &escape_intermediate},
-    {0x30, 0x4f, doescape, &ground},
-    {0x51, 0x57, doescape, &ground},
-    {0x59, 0x59, doescape, &ground},
-    {0x5a, 0x5a, doescape, &ground},
-    {0x5c, 0x5c, doescape, &ground},
-    {0x6b, 0x6b, ignore,   &osc_string},
-    {0x60, 0x7e, doescape, &ground},
-    {0x5b, 0x5b, ignore,   &csi_entry},
-    {0x5d, 0x5d, ignore,   &osc_string},
-    {0x5e, 0x5e, ignore,   &osc_string},
-    {0x50, 0x50, ignore,   &osc_string},
-    {0x5f, 0x5f, ignore,   &osc_string}
+MAKESTATE(escape, reset, NULL,
+    {0x21, 0x21, introduce, &osc_string},
+    {0x20, 0x2f, collect,   &escape_intermediate},
+    {0x30, 0x4f, doescape,  &ground},
+    {0x51, 0x57, doescape,  &ground},
+    {0x59, 0x59, doescape,  &ground},
+    {0x5a, 0x5a, doescape,  &ground},
+    {0x5c, 0x5c, doescape,  &ground},
+    {0x6b, 0x6b, introduce, &osc_string},
+    {0x60, 0x7e, doescape,  &ground},
+    {0x5b, 0x5b, ignore,    &csi_entry},
+    {0x5d, 0x5d, introduce, &osc_string},
+    {0x5e, 0x5e, introduce, &osc_string},
+    {0x50, 0x50, introduce, &osc_string},
+    {0x58, 0x58, introduce, &osc_string},
+    {0x5f, 0x5f, introduce, &osc_string}
 );
 
-MAKESTATE(escape_intermediate, NULL,
+MAKESTATE(escape_intermediate, NULL, NULL,
     {0x20, 0x2f, collect,  NULL},
     {0x30, 0x7e, doescape, &ground}
 );
 
-MAKESTATE(csi_entry, reset,
+MAKESTATE(csi_entry, reset, NULL,
     {0x20, 0x2f, collect, &csi_intermediate},
-    {0x3a, 0x3a, ignore,  &csi_ignore},
     {0x30, 0x39, param,   &csi_param},
-    {0x3b, 0x3b, param,   &csi_param},
+    {0x3a, 0x3b, param,   &csi_param},
     {0x3c, 0x3f, collect, &csi_param},
     {0x40, 0x7e, docsi,   &ground}
 );
 
-MAKESTATE(csi_ignore, NULL,
+MAKESTATE(csi_ignore, NULL, NULL,
     {0x20, 0x3f, ignore, NULL},
     {0x40, 0x7e, ignore, &ground}
 );
 
-MAKESTATE(csi_param, NULL,
+MAKESTATE(csi_param, NULL, NULL,
     {0x30, 0x39, param,   NULL},
-    {0x3b, 0x3b, param,   NULL},
-    {0x3a, 0x3a, ignore,  &csi_ignore},
+    {0x3a, 0x3b, param,   NULL},
     {0x3c, 0x3f, ignore,  &csi_ignore},
     {0x20, 0x2f, collect, &csi_intermediate},
     {0x40, 0x7e, docsi,   &ground}
 );
 
-MAKESTATE(csi_intermediate, NULL,
+MAKESTATE(csi_intermediate, NULL, NULL,
     {0x20, 0x2f, collect, NULL},
     {0x30, 0x3f, ignore,  &csi_ignore},
     {0x40, 0x7e, docsi,   &ground}
 );
 
-MAKESTATE(osc_string, reset,
-    {0x07, 0x07, doosc, &ground},
-    {0x20, 0x7f, collectosc, NULL}
+MAKESTATE(osc_string, startosc, endosc,
+    {0x07, 0x07,      ignore,     &ground},
+    {0x20, WCHAR_MAX, collectosc, NULL}
 );
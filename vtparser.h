@@ -27,6 +27,7 @@
 #ifndef VTC_H
 #define VTC_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <wchar.h>
 
@@ -45,34 +46,78 @@
 /**** DATA TYPES */
 #define MAXPARAM    16
 #define MAXCALLBACK 128
-#define MAXOSC      100
+#define MAXOSC      1024
 #define MAXBUF      100
+#define MAXPRINT    512
+
+/* VTPARSER_PRINTN, if set, receives runs of up to MAXPRINT printable
+ * characters in place of individual VTPARSER_PRINT events: argc is the
+ * length of the run and osc points to its (unterminated) characters.
+ */
+typedef enum{
+    VTPARSER_CONTROL,
+    VTPARSER_ESCAPE,
+    VTPARSER_CSI,
+    VTPARSER_OSC,
+    VTPARSER_PRINT,
+    VTPARSER_PRINTN
+} VtEvent;
+
+/* VTPARSER_OSC receives OSC, DCS, APC, PM and SOS strings as they arrive,
+ * however long they are. w is the character that introduced the string
+ * (L']' for OSC, L'P' for DCS, and so on) and iw says what's happening:
+ * VTPARSER_STRING_START begins a string, VTPARSER_STRING_DATA passes on
+ * its next argc (up to MAXOSC) characters, at osc, and VTPARSER_STRING_END
+ * ends it, with argc 1 if it was terminated and 0 if it was cancelled.
+ */
+typedef enum{
+    VTPARSER_STRING_START,
+    VTPARSER_STRING_DATA,
+    VTPARSER_STRING_END
+} VtString;
 
 typedef struct VTPARSER VTPARSER;
+typedef struct VTCALLBACKS VTCALLBACKS;
 typedef struct STATE STATE;
+typedef struct VTSTATS VTSTATS;
 typedef void (*VTCALLBACK)(VTPARSER *v, void *p, wchar_t w, wchar_t iw,
                            int argc, int *argv, const wchar_t *osc);
 
+struct VTCALLBACKS{ /* shared, read-only once parsing starts */
+    VTCALLBACK print, printn, osc, cons[MAXCALLBACK], escs[MAXCALLBACK],
+               csis[MAXCALLBACK];
+};
+
+/* Each parser counts what it has seen: events of each type (for
+ * VTPARSER_PRINT, every character printed, whether alone or in a run),
+ * and the callbacks made for each control, escape and CSI final character.
+ */
+struct VTSTATS{
+    unsigned long events[VTPARSER_PRINTN + 1];
+    unsigned long calls[VTPARSER_OSC][MAXCALLBACK];
+};
+
 struct VTPARSER{
-    STATE *s;
-    int narg, nosc, args[MAXPARAM], inter, oscbuf[MAXOSC + 1];
+    const STATE *s;
+    int narg, nosc, args[MAXPARAM], inter;
+    wchar_t str; /* what introduced the string being collected */
+    unsigned subs; /* bit i is set if args[i] followed a colon */
+    wchar_t oscbuf[MAXOSC + 1];
     mbstate_t ms;
+    bool utf8;
+    int u8need;
+    wchar_t u8cp, u8min;
     void *p;
-    VTCALLBACK print, osc, cons[MAXCALLBACK], escs[MAXCALLBACK],
-               csis[MAXCALLBACK];
+    const VTCALLBACKS *cb;
+    VTSTATS stats;
 };
 
-typedef enum{
-    VTPARSER_CONTROL,
-    VTPARSER_ESCAPE,
-    VTPARSER_CSI,
-    VTPARSER_OSC,
-    VTPARSER_PRINT
-} VtEvent;
-
 /**** FUNCTIONS */
 VTCALLBACK
-vtonevent(VTPARSER *vp, VtEvent t, wchar_t w, VTCALLBACK cb);
+vtonevent(VTCALLBACKS *vc, VtEvent t, wchar_t w, VTCALLBACK cb);
+
+void
+vtinit(VTPARSER *vp, const VTCALLBACKS *vc, void *p);
 
 void
 vtwrite(VTPARSER *vp, const char *s, size_t n);